@@ -20,8 +20,8 @@ unix {
 QMAKE_CXXFLAGS += -std=c++11 -Wall -Wextra
 QMAKE_CXXFLAGS_RELEASE += -std=c++11 -Wall -Wextra
 CONFIG += debug
-QT += widgets
+QT += widgets network
 # Input
 HEADERS += src/gdrawer.hpp
-SOURCES += src/parse.cpp src/vm.cpp src/main.cpp src/ui.cpp src/draw.cpp src/pascal.cpp
+SOURCES += src/parse.cpp src/vm.cpp src/main.cpp src/ui.cpp src/draw.cpp src/pascal.cpp src/engine.cpp src/bytecode.cpp src/isolate.cpp src/server.cpp src/fit.cpp src/jit.cpp src/profile.cpp src/cluster.cpp src/runs.cpp src/scanline.cpp src/specialize.cpp src/selftest.cpp
 RESOURCES += gdrawer.qrc
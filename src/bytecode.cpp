@@ -0,0 +1,206 @@
+#include "gdrawer.hpp"
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
+#include <cstring>
+
+/* Compiled MathVm file layout, all numbers little-endian:
+ *   header: magic "GDVM", version, stack size, instruction count, factor count, zero (quint32 each),
+ *           hash of the source formula, checksum of everything else (quint64 each)
+ *   instructions: 16 bytes each: type, arg, 6 zero bytes, val as an IEEE double
+ *   factors: instruction count of every factor of a top-level product (quint32 each),
+ *            in the order they are linked in
+ * Instructions are fixed size and aligned, so a mapped file is read without any parsing. */
+
+namespace
+{
+	const char magic[4] = { 'G', 'D', 'V', 'M' };
+	const quint32 version = 2;
+
+	struct Header
+	{
+		char magic[4];
+		quint32 version, stackSize, count, factorCount, reserved;
+		quint64 sourceHash, checksum;
+	};
+
+	struct Record
+	{
+		quint8 type, arg, pad[6];
+		quint64 val;
+	};
+
+	static_assert(sizeof(Header) == 40 && sizeof(Record) == 16, "Unexpected padding in compiled formula layout");
+
+	/* FNV-1a */
+	quint64 hash(const void* data, size_t size, quint64 h = 14695981039346656037ULL)
+	{
+		const quint8 *p = static_cast<const quint8*>(data);
+		for (size_t i = 0; i < size; ++i)
+		{
+			h = (h ^ p[i]) * 1099511628211ULL;
+		}
+		return h;
+	}
+
+	quint64 checksum(const Header& header, const Record* records, const quint32* factors)
+	{
+		Header h = header;
+		h.checksum = 0;
+		quint64 ret = hash(&h, sizeof(h));
+		ret = hash(records, sizeof(Record) * qFromLittleEndian(h.count), ret);
+		return hash(factors, sizeof(quint32) * qFromLittleEndian(h.factorCount), ret);
+	}
+}
+
+quint64 MathVm::sourceHash(const QString& source)
+{
+	QByteArray s = source.toUtf8();
+	return hash(s.constData(), s.size());
+}
+
+quint64 MathVm::codeHash(const std::vector<Instr>& code)
+{
+	quint64 ret = hash(NULL, 0);
+	for (auto& i : code)
+	{
+		ret = hash(&i.type, 1, ret);
+		ret = hash(&i.arg, 1, ret);
+		ret = hash(&i.val, sizeof(i.val), ret);
+	}
+	return ret;
+}
+
+void MathVm::save(const QString& filename, const QString& source) const
+{
+	std::vector<Record> records(size());
+	for (size_t i = 0; i < size(); ++i)
+	{
+		const Instr& instr = (*this)[i];
+		Record& r = records[i];
+		memset(&r, 0, sizeof(r));
+		r.type = instr.type;
+		r.arg = instr.arg;
+		quint64 val;
+		memcpy(&val, &instr.val, sizeof(val));
+		r.val = qToLittleEndian(val);
+	}
+
+	std::vector<quint32> factorSizes;
+	for (auto& factor : factors)
+	{
+		factorSizes.push_back(qToLittleEndian(quint32(factor.size())));
+	}
+
+	Header header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = qToLittleEndian(version);
+	header.stackSize = qToLittleEndian(quint32(requiredStackSize));
+	header.count = qToLittleEndian(quint32(size()));
+	header.factorCount = qToLittleEndian(quint32(factors.size()));
+	header.reserved = 0;
+	header.sourceHash = qToLittleEndian(sourceHash(source));
+	header.checksum = qToLittleEndian(checksum(header, records.data(), factorSizes.data()));
+
+	QSaveFile f(filename);
+	if (!f.open(QIODevice::WriteOnly))
+	{
+		throw Exception(QString("Cannot open %1 for writing").arg(filename));
+	}
+	f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	f.write(reinterpret_cast<const char*>(records.data()), sizeof(Record) * records.size());
+	f.write(reinterpret_cast<const char*>(factorSizes.data()), sizeof(quint32) * factorSizes.size());
+	if (!f.commit())
+	{
+		throw Exception(QString("Cannot write %1").arg(filename));
+	}
+}
+
+MathVm* MathVm::load(const QString& filename, const QString& source)
+{
+	QFile f(filename);
+	if (!f.open(QIODevice::ReadOnly))
+	{
+		throw Exception(QString("Cannot open %1").arg(filename));
+	}
+	qint64 fileSize = f.size();
+	uchar *data = fileSize >= qint64(sizeof(Header)) ? f.map(0, fileSize) : NULL;
+	if (!data)
+	{
+		throw Exception(QString("%1 is not a compiled formula").arg(filename));
+	}
+	std::unique_ptr<MathVm> ret;
+	try
+	{
+		const Header& header = *reinterpret_cast<const Header*>(data);
+		const Record *records = reinterpret_cast<const Record*>(data + sizeof(Header));
+		quint32 count = qFromLittleEndian(header.count), factorCount = qFromLittleEndian(header.factorCount);
+		const quint32 *factorSizes = reinterpret_cast<const quint32*>(records + count);
+		if (memcmp(header.magic, magic, sizeof(magic)))
+		{
+			throw Exception(QString("%1 is not a compiled formula").arg(filename));
+		}
+		if (qFromLittleEndian(header.version) != version)
+		{
+			throw Exception(QString("%1 was compiled by another version of gdrawer").arg(filename));
+		}
+		if (fileSize != qint64(sizeof(Header) + sizeof(Record) * quint64(count) + sizeof(quint32) * quint64(factorCount))
+			|| checksum(header, records, factorSizes) != qFromLittleEndian(header.checksum))
+		{
+			throw Exception(QString("%1 is corrupted").arg(filename));
+		}
+		if (!source.isNull() && sourceHash(source) != qFromLittleEndian(header.sourceHash))
+		{
+			throw Exception(QString("%1 is stale, recompile it").arg(filename));
+		}
+
+		ret.reset(new MathVm);
+		ret->requiredStackSize = qFromLittleEndian(header.stackSize);
+		ret->reserve(count);
+		for (quint32 i = 0; i < count; ++i)
+		{
+			quint64 bits = qFromLittleEndian(records[i].val);
+			real_t val;
+			memcpy(&val, &bits, sizeof(val));
+			ret->emplace_back(records[i].type, records[i].arg, val);
+			if (strchr("PQpd", ret->back().type))
+			{
+				/* Polynomials are found again after loading and specialized code is derived for every render,
+				 * they are not saved */
+				throw Exception(QString("%1 is corrupted").arg(filename));
+			}
+		}
+		ret->verify();
+		/* The contexts of the formula are allocated with the stack size of the header */
+		if (ret->requiredStackSize > ret->stackDepth())
+		{
+			throw Exception(QString("%1 is corrupted").arg(filename));
+		}
+
+		/* Factors are linked as f1 Z f2 Z * f3 Z * ... */
+		size_t pos = 0;
+		for (quint32 i = 0; i < factorCount; ++i)
+		{
+			size_t end = pos + qFromLittleEndian(factorSizes[i]), next = end + (i ? 2 : 1);
+			if (next > count || (*ret)[end].type != 'Z' || (i && (*ret)[end + 1].type != '*'))
+			{
+				throw Exception(QString("%1 is corrupted").arg(filename));
+			}
+			ret->factors.emplace_back(ret->begin() + pos, ret->begin() + end);
+			pos = next;
+		}
+		if (factorCount && pos != count)
+		{
+			throw Exception(QString("%1 is corrupted").arg(filename));
+		}
+		ret->compile();
+		ret->findPolynomials();
+	}
+	catch (Exception)
+	{
+		f.unmap(data);
+		throw;
+	}
+	f.unmap(data);
+	return ret.release();
+}
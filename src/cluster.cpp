@@ -0,0 +1,282 @@
+#include "gdrawer.hpp"
+#include <QThread>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QDebug>
+#include <cstring>
+
+/* The coordinator sends every tile to a render server as a request for its part of the rect, see
+ * server.cpp. Every worker connection has one tile in flight, a server may be listed several times
+ * to keep more of its threads busy. Workers on other hosts are render servers listening on host:port, started
+ * with an address they can be reached at, such as --serve 0.0.0.0:port. Tiles must fit the size limit of remote requests */
+
+namespace
+{
+	const int maxAttempts = 3;
+	const int tileTimeout = 60000;
+
+	struct Tile
+	{
+		QRect pixels;
+		int attempts;
+	};
+
+	/* State shared by the connections of one render */
+	struct Cluster
+	{
+		QMutex mutex;
+		QWaitCondition changed;
+		std::deque<Tile> queue;
+		/* Tiles which are not rendered yet, connections which are still alive */
+		int pending, alive;
+		QString error;
+		ClusterStats stats;
+
+		QImage *img;
+		QRectF rect;
+		QString backend, source;
+	};
+
+	class Connection : public QThread
+	{
+		public:
+			Connection(Cluster* _cluster, const QString& _address): cluster(_cluster), address(_address) {}
+
+		protected:
+			void run()
+			{
+				QString error;
+				std::unique_ptr<QIODevice> socket(connectToServer(address, 5000, &error));
+				while (socket)
+				{
+					Tile tile;
+					{
+						QMutexLocker lock(&cluster->mutex);
+						while (cluster->queue.empty() && cluster->pending && cluster->error.isNull())
+						{
+							cluster->changed.wait(&cluster->mutex);
+						}
+						if (!cluster->pending || !cluster->error.isNull())
+						{
+							return;
+						}
+						tile = cluster->queue.front();
+						cluster->queue.pop_front();
+					}
+
+					bool lost = false;
+					bool ok = render(&*socket, tile, &error, &lost);
+					QMutexLocker lock(&cluster->mutex);
+					if (ok)
+					{
+						--cluster->pending;
+						++cluster->stats.done[address];
+					}
+					else if (++tile.attempts < maxAttempts)
+					{
+						qDebug() << "Retrying tile" << tile.pixels << "after" << error;
+						++cluster->stats.retries;
+						cluster->queue.push_back(tile);
+					}
+					else
+					{
+						cluster->error = error;
+					}
+					cluster->changed.wakeAll();
+					if (lost)
+					{
+						socket.reset();
+					}
+				}
+
+				qWarning() << "Lost worker" << address << error;
+				QMutexLocker lock(&cluster->mutex);
+				if (!--cluster->alive && cluster->pending && cluster->error.isNull())
+				{
+					cluster->error = QString("All workers are lost, the last one with: %1").arg(error);
+				}
+				cluster->changed.wakeAll();
+			}
+
+		private:
+			Cluster *cluster;
+			QString address;
+
+			/* lost is set when the connection cannot be used any more */
+			bool render(QIODevice* socket, const Tile& tile, QString* error, bool* lost)
+			{
+				const QRect& p = tile.pixels;
+				real_t dx = cluster->rect.width() / cluster->img->width(), dy = cluster->rect.height() / cluster->img->height();
+				real_t left = cluster->rect.left(), bottom = cluster->rect.bottom();
+				QJsonObject request;
+				request["formula"] = cluster->source;
+				request["backend"] = cluster->backend;
+				request["rect"] = QJsonArray() << left + p.left() * dx << bottom - (p.bottom() + 1) * dy
+					<< left + (p.right() + 1) * dx << bottom - p.top() * dy;
+				request["size"] = QJsonArray() << p.width() << p.height();
+				request["raw"] = true;
+				socket->write(QJsonDocument(request).toJson(QJsonDocument::Compact) + '\n');
+
+				while (!socket->canReadLine())
+				{
+					if (!socket->waitForReadyRead(tileTimeout))
+					{
+						*error = QString("%1: %2").arg(address).arg(socket->errorString());
+						*lost = true;
+						return false;
+					}
+				}
+				QJsonObject reply = QJsonDocument::fromJson(socket->readLine()).object();
+				if (!reply["ok"].toBool())
+				{
+					*error = QString("%1: %2").arg(address).arg(reply["error"].toString("invalid reply"));
+					return false;
+				}
+				QByteArray raw = QByteArray::fromBase64(reply["raw"].toString().toLatin1());
+				if (raw.size() != p.width() * p.height())
+				{
+					*error = QString("%1: the tile has a wrong size").arg(address);
+					return false;
+				}
+				/* Tiles do not overlap, so connections write to the picture without locking */
+				for (int y = 0; y < p.height(); ++y)
+				{
+					memcpy(cluster->img->scanLine(p.top() + y) + p.left(), raw.constData() + y * p.width(), p.width());
+				}
+				return true;
+			}
+	};
+}
+
+QImage drawDistributed(const QStringList& workers, const QString& backend, const QString& source,
+	const QRectF& rect, const QSize& viewport, int tileSize, ClusterStats* stats)
+{
+	if (workers.isEmpty())
+	{
+		throw Exception("No workers");
+	}
+	QElapsedTimer timer;
+	timer.start();
+	QImage ret(viewport, QImage::Format_Indexed8);
+	ret.setColor(0, qRgb(255, 255, 255));
+	ret.setColor(1, qRgb(0, 0, 0));
+	ret.setColor(2, qRgb(255, 255, 0));
+	ret.fill(2);
+
+	Cluster cluster;
+	cluster.img = &ret;
+	cluster.rect = rect;
+	cluster.backend = backend;
+	cluster.source = source;
+	for (int y = 0; y < viewport.height(); y += tileSize)
+	{
+		for (int x = 0; x < viewport.width(); x += tileSize)
+		{
+			Tile tile = { QRect(x, y, std::min(tileSize, viewport.width() - x), std::min(tileSize, viewport.height() - y)), 0 };
+			cluster.queue.push_back(tile);
+		}
+	}
+	cluster.pending = cluster.stats.tiles = cluster.queue.size();
+	cluster.alive = workers.size();
+
+	std::vector<std::unique_ptr<Connection>> connections;
+	for (auto& worker : workers)
+	{
+		connections.emplace_back(new Connection(&cluster, worker));
+		connections.back()->start();
+	}
+	for (auto& connection : connections)
+	{
+		connection->wait();
+	}
+
+	cluster.stats.ms = timer.elapsed();
+	if (stats) *stats = cluster.stats;
+	if (!cluster.error.isNull())
+	{
+		throw Exception(cluster.error);
+	}
+	return ret;
+}
+
+/* gdrawer --distribute formula.txt [--size WxH] [--tile N] [--output file.png] [--scaling] worker...
+ * With --scaling the picture is rendered on the first 1, 2, ... workers and the speedup is printed */
+int runCoordinator(const QStringList& args)
+{
+	QTextStream out(stdout);
+	QString file, output;
+	QStringList workers;
+	QSize size(2048, 2048);
+	int tileSize = 256;
+	bool scaling = false;
+	for (int i = 2; i < args.size(); ++i)
+	{
+		if (args[i] == "--size" && i + 1 < args.size())
+		{
+			QStringList parts = args[++i].split('x');
+			size = QSize(parts.value(0).toInt(), parts.value(1).toInt());
+		}
+		else if (args[i] == "--tile" && i + 1 < args.size())
+			tileSize = args[++i].toInt();
+		else if (args[i] == "--output" && i + 1 < args.size())
+			output = args[++i];
+		else if (args[i] == "--scaling")
+			scaling = true;
+		else if (file.isNull())
+			file = args[i];
+		else
+			workers << args[i];
+	}
+	if (file.isNull() || workers.isEmpty() || size.isEmpty() || tileSize < 1)
+	{
+		out << "Usage: gdrawer --distribute formula.txt [--size WxH] [--tile N] [--output file.png] [--scaling] worker...\n"
+		    << "Workers are render servers: local names or host:port\n";
+		return 1;
+	}
+
+	try
+	{
+		/* Servers on other hosts get the formula itself */
+		QStringList parts;
+		QString source = readFormula(file, &parts);
+		QRectF rect(QPointF(-10, -10), QPointF(10, 10));
+		if (parts.size() == 4)
+		{
+			rect = QRectF(QPointF(parts[0].toDouble(), parts[1].toDouble()), QPointF(parts[2].toDouble(), parts[3].toDouble()));
+		}
+
+		QImage img;
+		qint64 single = 0;
+		for (int n = scaling ? 1 : workers.size(); n <= workers.size(); ++n)
+		{
+			ClusterStats stats;
+			img = drawDistributed(workers.mid(0, n), "math", source, rect, size, tileSize, &stats);
+			if (n == 1) single = stats.ms;
+			out << QString("%1 workers: %2 ms, %3 tiles, %4 retries").arg(n).arg(stats.ms).arg(stats.tiles).arg(stats.retries);
+			if (single && stats.ms)
+			{
+				double speedup = double(single) / stats.ms;
+				out << QString(", speedup %1, efficiency %2%").arg(speedup, 0, 'f', 2).arg(100 * speedup / n, 0, 'f', 0);
+			}
+			out << "\n";
+			for (auto i = stats.done.begin(); i != stats.done.end(); ++i)
+			{
+				out << "  " << i.key() << ": " << i.value() << " tiles\n";
+			}
+			out.flush();
+		}
+		if (!output.isEmpty() && !img.save(output))
+		{
+			throw Exception(QString("Cannot save %1").arg(output));
+		}
+	}
+	catch (Exception e)
+	{
+		out << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
@@ -1,93 +1,877 @@
 #include "gdrawer.hpp"
-#include <QThreadPool>
-#include <QRunnable>
 #include <QDebug>
+#include <QDir>
+#include <atomic>
+
+/* Jobs which fill the factor states of a FactorCache. Destroying it cancels them and waits for them to stop */
+struct FactorFill
+{
+	RenderEngine *engine;
+	std::shared_ptr<RenderEngine::Batch> batch;
+	std::atomic<bool> cancelled;
+
+	FactorFill(RenderEngine* _engine): engine(_engine), cancelled(false) {}
+	~FactorFill()
+	{
+		cancelled = true;
+		try
+		{
+			if (batch) engine->wait(batch);
+		}
+		catch (Exception)
+		{
+			/* The states are only written after evaluating, the ones which failed stay unevaluated */
+		}
+	}
+};
 
 namespace
 {
-	class Task : public QRunnable
+	QImage createImage(const QSize& viewport)
+	{
+		QImage ret(viewport, QImage::Format_Indexed8);
+		ret.setColor(0, qRgb(255, 255, 255));
+		ret.setColor(1, qRgb(0, 0, 0));
+		ret.setColor(2, qRgb(255, 255, 0));
+		ret.fill(2);
+		return ret;
+	}
+
+	/* Pixel columns are the same for every row */
+	const Real* columns(const QRectF& rect, int width, std::vector<Real>& xs)
+	{
+		real_t dx = rect.width() / width;
+		xs.resize(width);
+		for (int px = 0; px != width; ++px)
+		{
+			real_t x = rect.left() + px * dx;
+			xs[px] = Real(x, x + dx);
+		}
+		return xs.data();
+	}
+
+	/* The code which renders rows [top, bottom) of a picture of rect. Math formulas are specialized to the ranges
+	 * of the variables over these rows, and the ones with a scanline program run that */
+	struct RowProgram
 	{
+		const Vm *vm;
+		std::shared_ptr<MathVm> specialized;
+		real_t left, dx;
+
+		RowProgram(const Vm* _vm, const QRectF& rect, const QSize& size, int top, int bottom,
+			char param = 0, const Real& paramRange = Real()):
+			vm(_vm), left(rect.left()), dx(rect.width() / size.width())
+		{
+			auto math = dynamic_cast<const MathVm*>(vm);
+			if (!math)
+			{
+				return;
+			}
+			if (math->scanline)
+			{
+				math = &*math->scanline;
+			}
+			/* The pixels are computed like columns() and renderRow() do */
+			real_t dy = rect.height() / size.height();
+			std::array<Real, 26> vars;
+			vars.fill(Real(-INFINITY, INFINITY));
+			if (param)
+			{
+				vars[param - 'a'] = paramRange;
+			}
+			vars['x' - 'a'] = Real(rect.left(), rect.left() + (size.width() - 1) * dx + dx);
+			vars['y' - 'a'] = Real(rect.bottom() - (bottom - 1) * dy, rect.bottom() - top * dy + dy);
+			specialized = math->specialize(vars);
+			if (specialized)
+			{
+				math = &*specialized;
+			}
+			vm = math;
+		}
+
+		/* A scanline keeps the state of its row, so every band which runs the program needs its own */
+		Scanline* scanline() const
+		{
+			auto math = dynamic_cast<const MathVm*>(vm);
+			return math && !math->polys.empty() ? new Scanline(math, left, dx) : NULL;
+		}
+	};
+
+	/* Renders pixel row py of a picture of rect with the given height */
+	void renderRow(Ctx* ctx, const Vm* vm, const Real* xs, int width, const QRectF& rect, int height, int py, uchar* line,
+		Scanline* scanline)
+	{
+		real_t dy = rect.height() / height, y = rect.bottom() - py * dy;
+		ctx->setVar('y', Real(y, y + dy));
+		if (scanline)
+		{
+			scanline->beginRow(static_cast<MathCtx*>(ctx), Real(y, y + dy));
+		}
+		for (int px = 0; px != width; ++px)
+		{
+			ctx->setVar('x', xs[px]);
+			ctx->reset();
+			try
+			{
+				Real res = vm->execute(ctx);
+				line[px] = res.isZero();
+			}
+			catch (Exception e0)
+			{
+				e0.append(QString("Point: (%1, %2)").arg(double(xs[px].min)).arg(double(y)));
+				throw e0;
+			}
+			if (scanline)
+			{
+				scanline->nextPixel();
+			}
+		}
+	}
+
+	/* Renders rows [top, bottom) of img, which shows rect, by a program made for them */
+	void renderBand(RenderSlot& slot, QImage* img, const QRectF& rect, int top, int bottom,
+		const Vm* vm, const RowProgram& program, const Real* xs, char param = 0, real_t paramValue = 0)
+	{
+		Ctx *ctx = slot.getCtx(vm);
+		if (param)
+		{
+			ctx->setVar(param, Real(paramValue));
+		}
+		std::unique_ptr<Scanline> scanline(program.scanline());
+		for (int py = top; py != bottom; ++py)
+		{
+			renderRow(ctx, program.vm, xs, img->width(), rect, img->height(), py, img->scanLine(py), scanline.get());
+		}
+	}
+
+	/* Splits rows [0, height) into more bands than there are workers, so that slow bands do not stall the render */
+	std::vector<std::pair<int, int>> bandRows(RenderEngine* engine, int height)
+	{
+		int bands = std::min(4 * engine->threadCount(), height);
+		std::vector<std::pair<int, int>> ret;
+		for (int i = 0; i < bands; ++i)
+		{
+			ret.emplace_back(height * i / bands, height * (i + 1) / bands);
+		}
+		return ret;
+	}
+
+	std::vector<RenderEngine::Job> splitRows(RenderEngine* engine, int height,
+		const std::function<void(RenderSlot&, int, int)>& band)
+	{
+		std::vector<RenderEngine::Job> jobs;
+		for (auto& rows : bandRows(engine, height))
+		{
+			int top = rows.first, bottom = rows.second;
+			jobs.push_back([=](RenderSlot& slot) { band(slot, top, bottom); });
+		}
+		return jobs;
+	}
+
+	std::vector<RenderEngine::Job> bandJobs(RenderEngine* engine, QImage* img, const QRectF& rect, const Vm* vm)
+	{
+		return splitRows(engine, img->height(), [=](RenderSlot& slot, int top, int bottom)
+		{
+			const Real *xs = columns(rect, img->width(), slot.scratch);
+			renderBand(slot, img, rect, top, bottom, vm, RowProgram(vm, rect, img->size(), top, bottom), xs);
+		});
+	}
+
+	/* FactorCache keeps a state per factor and pixel. Values which contain zero end the linked code, like Z does.
+	 * Others are kept as 3 + e for the largest e in [-31, 221] with 2^e <= |v|, values too close to zero for
+	 * that or NaN are tiny */
+	const uchar notEvaluated = 0, zeroFactor = 1, tiny = 2;
+	/* Products of at least 2^minExponent are well away from zero */
+	const int minExponent = std::ilogb(2 * EPS) + 1;
+
+	uchar factorState(const Real& v)
+	{
+		if (v.containsZero())
+		{
+			return zeroFactor;
+		}
+		if (std::isnan(v.min) || std::isnan(v.max))
+		{
+			return tiny;
+		}
+		real_t m = std::min(std::fabs(v.min), std::fabs(v.max));
+		if (std::isinf(m))
+		{
+			return 255;
+		}
+		int e;
+		std::frexp(m, &e);
+		return e - 1 < -31 ? tiny : uchar(3 + std::min(e + 30, 252));
+	}
+
+	/* The code of the factors of a formula in the order of the linked code, and their states in a FactorCache.
+	 * Jobs which fill the states after the render keep it, so it owns everything they use */
+	struct Factors
+	{
+		std::vector<std::unique_ptr<MathVm>> code;
+		std::vector<std::shared_ptr<std::vector<uchar>>> buffers;
+		std::vector<uchar*> states;
+		/* The factor which needs the largest context */
+		const MathVm *largest;
+	};
+
+	/* Takes the states of the factors of vm from the cache and keeps only those in it */
+	std::shared_ptr<Factors> cachedFactors(const MathVm* vm, FactorCache* cache)
+	{
+		size_t pixels = size_t(cache->viewport.width()) * cache->viewport.height();
+		std::shared_ptr<Factors> ret(new Factors);
+		std::map<quint64, std::shared_ptr<std::vector<uchar>>> used;
+		int changed = 0;
+		for (size_t i = 0; i < std::max<size_t>(vm->factors.size(), 1); ++i)
+		{
+			if (vm->factors.empty())
+			{
+				ret->code.emplace_back(new MathVm(*vm));
+			}
+			else
+			{
+				MathVm *code = new MathVm;
+				ret->code.emplace_back(code);
+				code->assign(vm->factors[i].begin(), vm->factors[i].end());
+				code->requiredStackSize = code->stackDepth();
+				code->compile();
+				code->findPolynomials();
+			}
+			const MathVm *code = &*ret->code.back();
+			if (i == 0 || code->requiredStackSize > ret->largest->requiredStackSize)
+			{
+				ret->largest = code;
+			}
+
+			quint64 key = MathVm::codeHash(*code);
+			auto& buffer = used[key];
+			if (!buffer)
+			{
+				auto cached = cache->factors.find(key);
+				if (cached != cache->factors.end())
+				{
+					buffer = cached->second;
+				}
+				else
+				{
+					buffer = std::make_shared<std::vector<uchar>>(pixels, notEvaluated);
+					++changed;
+				}
+			}
+			ret->buffers.push_back(buffer);
+			ret->states.push_back(buffer->data());
+		}
+		qDebug() << "factors:" << ret->code.size() << "changed:" << changed;
+		cache->factors.swap(used);
+		return ret;
+	}
+
+	/* Renders like renderBand() from the factor states, evaluating the factors which are not known yet in
+	 * the order of the linked code. The product of factors which exclude zero is computed again where their
+	 * states do not rule out that it contains zero. Without img, only the states are filled, until cancelled */
+	void combineBand(RenderSlot& slot, QImage* img, const QSize& viewport, const QRectF& rect, int top, int bottom,
+		const Factors& factors, const std::atomic<bool>* cancelled = NULL)
+	{
+		int width = viewport.width();
+		real_t dy = rect.height() / viewport.height();
+		Ctx *ctx = slot.getCtx(factors.largest);
+		const Real *xs = columns(rect, width, slot.scratch);
+		size_t count = factors.code.size();
+		const std::vector<uchar*>& states = factors.states;
+		std::vector<std::unique_ptr<RowProgram>> programs(count);
+		std::vector<std::unique_ptr<Scanline>> scanlines(count);
+		std::vector<char> need(width);
+		std::vector<uchar> scratch(img ? 0 : width);
+		std::vector<Real> values(width), products(width);
+
+		/* Factor k by the program renderBand() would run for it, at the pixels of the row which need it */
+		auto evaluate = [&](size_t k, real_t y)
+		{
+			if (!programs[k])
+			{
+				programs[k].reset(new RowProgram(&*factors.code[k], rect, viewport, top, bottom));
+				scanlines[k].reset(programs[k]->scanline());
+			}
+			Scanline *scanline = scanlines[k].get();
+			if (scanline)
+			{
+				scanline->beginRow(static_cast<MathCtx*>(ctx), Real(y, y + dy));
+			}
+			for (int px = 0; px != width; ++px)
+			{
+				if (need[px])
+				{
+					ctx->setVar('x', xs[px]);
+					ctx->reset();
+					try
+					{
+						values[px] = programs[k]->vm->execute(ctx);
+					}
+					catch (Exception e0)
+					{
+						e0.append(QString("Point: (%1, %2)").arg(double(xs[px].min)).arg(double(y)));
+						throw e0;
+					}
+				}
+				if (scanline)
+				{
+					scanline->nextPixel();
+				}
+			}
+		};
+
+		for (int py = top; py != bottom && !(cancelled && *cancelled); ++py)
+		{
+			real_t y = rect.bottom() - py * dy;
+			uchar *line = img ? img->scanLine(py) : scratch.data();
+			size_t row = size_t(py) * width;
+			memset(line, 0, width);
+			ctx->setVar('y', Real(y, y + dy));
+			for (size_t k = 0; k != count; ++k)
+			{
+				uchar *state = states[k] + row;
+				bool needed = false;
+				for (int px = 0; px != width; ++px)
+				{
+					need[px] = !line[px] && state[px] == notEvaluated;
+					needed = needed || need[px];
+				}
+				if (needed)
+				{
+					evaluate(k, y);
+				}
+				for (int px = 0; px != width; ++px)
+				{
+					if (need[px])
+					{
+						state[px] = factorState(values[px]);
+					}
+					line[px] = line[px] || state[px] == zeroFactor;
+				}
+			}
+
+			if (!img)
+			{
+				continue;
+			}
+
+			/* The product of the values is at least 2^e in magnitude */
+			bool needed = false;
+			for (int px = 0; px != width; ++px)
+			{
+				int e = 0;
+				bool small = false;
+				for (size_t k = 0; k != count && !line[px] && !small; ++k)
+				{
+					uchar state = states[k][row + px];
+					small = state == tiny;
+					e += state - 34;
+				}
+				need[px] = !line[px] && (small || e < minExponent);
+				needed = needed || need[px];
+			}
+			if (!needed)
+			{
+				continue;
+			}
+			for (size_t k = 0; k != count; ++k)
+			{
+				evaluate(k, y);
+				for (int px = 0; px != width; ++px)
+				{
+					if (need[px])
+					{
+						products[px] = k ? products[px] * values[px] : values[px];
+					}
+				}
+			}
+			for (int px = 0; px != width; ++px)
+			{
+				if (need[px])
+				{
+					line[px] = products[px].isZero();
+				}
+			}
+		}
+	}
+
+	QImage drawCached(MathVm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine,
+		FactorCache* cache)
+	{
+		/* Stops filling the states of the last render, the ones it did not reach are evaluated when needed */
+		cache->fill.reset();
+		/* The programs of the factors are specialized to the bands */
+		int bands = bandRows(engine, viewport.height()).size();
+		bool cold = cache->rect != rect || cache->viewport != viewport || cache->bands != bands;
+		if (cold)
+		{
+			cache->factors.clear();
+			cache->rect = rect;
+			cache->viewport = viewport;
+			cache->bands = bands;
+		}
+		std::shared_ptr<Factors> factors = cachedFactors(vm, cache);
+
+		QImage ret = createImage(viewport);
+		QImage *img = &ret;
+		if (!cold)
+		{
+			engine->run(splitRows(engine, viewport.height(), [=](RenderSlot& slot, int top, int bottom)
+			{
+				combineBand(slot, img, viewport, rect, top, bottom, *factors);
+			}));
+			return ret;
+		}
+
+		/* Nothing can be reused, so the picture is rendered without the cache. The engine fills the
+		 * states afterwards, while the picture is shown, so that the next edit finds them */
+		engine->run(bandJobs(engine, img, rect, vm));
+		std::shared_ptr<FactorFill> fill(new FactorFill(engine));
+		const std::atomic<bool> *cancelled = &fill->cancelled;
+		fill->batch = engine->submit(splitRows(engine, viewport.height(), [=](RenderSlot& slot, int top, int bottom)
+		{
+			combineBand(slot, NULL, viewport, rect, top, bottom, *factors, cancelled);
+		}));
+		cache->fill = fill;
+		return ret;
+	}
+
+	/* Every corner is shared by four pixels and evaluated once per band, two rows of corners are kept.
+	 * Corner row k lies at the bottom of pixel row k - 1, where point sampling evaluates that row */
+	void renderLattice(QImage* img, const QRectF& rect, int top, int bottom, const PascalVm* vm)
+	{
+		int width = img->width();
+		real_t dx = rect.width() / width, dy = rect.height() / img->height();
+		std::vector<char> upper(width + 1), lower(width + 1);
+		auto sample = [&](std::vector<char>& row, int k)
+		{
+			real_t y = rect.bottom() - (k - 1) * dy;
+			for (int i = 0; i <= width; ++i)
+			{
+				row[i] = vm->fn(rect.left() + i * dx, y) != 0;
+			}
+		};
+
+		sample(upper, top);
+		for (int py = top; py != bottom; ++py)
+		{
+			sample(lower, py + 1);
+			uchar *line = img->scanLine(py);
+			for (int px = 0; px != width; ++px)
+			{
+				int corners = upper[px] + upper[px + 1] + lower[px] + lower[px + 1];
+				line[px] = corners != 0 && corners != 4;
+			}
+			upper.swap(lower);
+		}
+	}
+
+	/* Quadtree of drawCertified() over a tile of the picture. Pixels are tested like renderRow() does */
+	class Certifier
+	{
+		public:
+			Certifier(Ctx* _ctx, const MathVm* _vm, QImage* _img, const QRectF& _rect):
+				ctx(_ctx), vm(_vm), img(_img), rect(_rect),
+				dx(_rect.width() / _img->width()), dy(_rect.height() / _img->height()) {}
+
+			/* Renders pixels [px0, px1) x [py0, py1) */
+			void cell(int px0, int py0, int px1, int py1)
+			{
+				if ((px1 - px0) * (py1 - py0) <= smallCell)
+				{
+					pixels(px0, py0, px1, py1);
+					return;
+				}
+				Real xs = columns(px0, px1), ys = rows(py0, py1), gx, gy;
+				try
+				{
+					if (!evaluate(xs, ys).isZero())
+					{
+						fill(px0, py0, px1, py1);
+						return;
+					}
+					vm->executeGrad(ctx, &gx, &gy);
+					if (int sign = monotone(gy))
+					{
+						/* An interval Newton step in y rules out the cells the curve does not cross */
+						real_t mid = (ys.min + ys.max) / 2;
+						Real n = Real(mid) - evaluate(xs, Real(mid)) / gy;
+						if (n.max < ys.min || n.min > ys.max)
+						{
+							fill(px0, py0, px1, py1);
+						}
+						else
+						{
+							crossings(px0, py0, px1, py1, true, sign);
+						}
+						return;
+					}
+					if (int sign = monotone(gx))
+					{
+						real_t mid = (xs.min + xs.max) / 2;
+						Real n = Real(mid) - evaluate(Real(mid), ys) / gx;
+						if (n.max < xs.min || n.min > xs.max)
+						{
+							fill(px0, py0, px1, py1);
+						}
+						else
+						{
+							crossings(px0, py0, px1, py1, false, sign);
+						}
+						return;
+					}
+				}
+				catch (Exception)
+				{
+					/* Smaller cells may not contain the bad point */
+				}
+				int mx = px1 - px0 > 1 ? (px0 + px1) / 2 : px1, my = py1 - py0 > 1 ? (py0 + py1) / 2 : py1;
+				cell(px0, py0, mx, my);
+				if (mx != px1) cell(mx, py0, px1, my);
+				if (my != py1) cell(px0, my, mx, py1);
+				if (mx != px1 && my != py1) cell(mx, my, px1, py1);
+			}
+
 		private:
+			static const int smallCell = 4;
+			Ctx *ctx;
+			const MathVm *vm;
 			QImage *img;
 			QRectF rect;
-			QRect viewport;
-			Vm *vm;
-			QAtomicPointer<Exception>* e;
-		public:
-			Task(QImage* _img, const QRectF& _rect, const QRect& _viewport, Vm *_vm, QAtomicPointer<Exception>* _e);
-			void run();
+			real_t dx, dy;
+
+			/* Row py shows [bottom - py * dy, bottom - py * dy + dy] */
+			Real columns(int px0, int px1) const
+			{
+				return Real(rect.left() + px0 * dx, rect.left() + px1 * dx);
+			}
+			Real rows(int py0, int py1) const
+			{
+				return Real(rect.bottom() - (py1 - 1) * dy, rect.bottom() - py0 * dy + dy);
+			}
+
+			Real evaluate(const Real& x, const Real& y)
+			{
+				ctx->setVar('x', x);
+				ctx->setVar('y', y);
+				ctx->reset();
+				return vm->execute(ctx);
+			}
+
+			/* The sign of a derivative which does not change over the cell, or zero */
+			static int monotone(const Real& d)
+			{
+				if (!std::isfinite(d.min) || !std::isfinite(d.max))
+				{
+					return 0;
+				}
+				return d.min > EPS ? 1 : d.max < -EPS ? -1 : 0;
+			}
+
+			void fill(int px0, int py0, int px1, int py1)
+			{
+				for (int py = py0; py != py1; ++py)
+				{
+					memset(img->scanLine(py) + px0, 0, px1 - px0);
+				}
+			}
+
+			void pixels(int px0, int py0, int px1, int py1)
+			{
+				for (int py = py0; py != py1; ++py)
+				{
+					uchar *line = img->scanLine(py);
+					for (int px = px0; px != px1; ++px)
+					{
+						line[px] = pixel(px, py);
+					}
+				}
+			}
+
+			bool pixel(int px, int py)
+			{
+				real_t x = rect.left() + px * dx, y = rect.bottom() - py * dy;
+				try
+				{
+					return evaluate(Real(x, x + dx), Real(y, y + dy)).isZero();
+				}
+				catch (Exception e0)
+				{
+					e0.append(QString("Point: (%1, %2)").arg(double(x)).arg(double(y)));
+					throw e0;
+				}
+			}
+
+			/* The value is monotone along y when alongY is set and along x otherwise, growing if sign is
+			 * positive. Every column or row then crosses zero once, between the last pixel whose far part
+			 * of the cell may be below zero and the first one whose near part may be above it. Those parts
+			 * only grow or shrink from pixel to pixel, so both are found by bisection */
+			void crossings(int px0, int py0, int px1, int py1, bool alongY, int sign)
+			{
+				fill(px0, py0, px1, py1);
+				Real span = alongY ? rows(py0, py1) : columns(px0, px1);
+				real_t step = alongY ? dy : dx;
+				int lines = alongY ? px1 - px0 : py1 - py0, n = alongY ? py1 - py0 : px1 - px0;
+				for (int k = 0; k != lines; ++k)
+				{
+					Real line = alongY ? columns(px0 + k, px0 + k + 1) : rows(py0 + k, py0 + k + 1);
+					auto value = [&](const Real& part)
+					{
+						Real v = alongY ? evaluate(line, part) : evaluate(part, line);
+						return sign > 0 ? v : -v;
+					};
+					/* Pixel j along the line and the rest of the cell after it may be below zero */
+					auto below = [&](int j)
+					{
+						try
+						{
+							return value(Real(span.min + j * step, span.max)).min <= EPS;
+						}
+						catch (Exception)
+						{
+							return true;
+						}
+					};
+					/* The cell up to pixel j may be above zero */
+					auto above = [&](int j)
+					{
+						try
+						{
+							return value(Real(span.min, span.min + (j + 1) * step)).max >= -EPS;
+						}
+						catch (Exception)
+						{
+							return true;
+						}
+					};
+					int last = -1, first = n;
+					for (int hi = n; hi - last > 1; )
+					{
+						int mid = (last + hi) / 2;
+						if (below(mid)) last = mid;
+						else hi = mid;
+					}
+					for (int lo = -1; first - lo > 1; )
+					{
+						int mid = (lo + first) / 2;
+						if (above(mid)) first = mid;
+						else lo = mid;
+					}
+					/* Pixels go up the picture along y */
+					for (int j = first; j <= last; ++j)
+					{
+						int px = alongY ? px0 + k : px0 + j, py = alongY ? py1 - 1 - j : py0 + k;
+						img->scanLine(py)[px] = pixel(px, py);
+					}
+				}
+			}
 	};
+
+	struct Frame
+	{
+		QImage img;
+		QString fileName;
+		std::shared_ptr<RenderEngine::Batch> batch;
+	};
+
+	/* Tiles which the workers could not render are errors outside the window */
+	QImage drawAllIsolated(const IsolatedVm* vm, const QRectF& rect, const QSize& viewport)
+	{
+		QStringList errors;
+		QImage ret = drawIsolated(vm, rect, viewport, 5000, &errors);
+		if (!errors.isEmpty())
+		{
+			throw Exception(errors.join("\n"));
+		}
+		return ret;
+	}
+
+	QString frameName(const QString& dir, int i)
+	{
+		return QDir(dir).filePath(QString("frame%1.png").arg(i, 4, 10, QChar('0')));
+	}
+
+	void saveFrame(RenderEngine* engine, Frame& frame)
+	{
+		engine->wait(frame.batch);
+		if (!frame.img.save(frame.fileName))
+		{
+			throw Exception(QString("Cannot save %1").arg(frame.fileName));
+		}
+	}
 }
 
-QImage drawFormula(Vm* vm, const QRectF& rect, const QSize& viewport)
+QImage drawFormula(Vm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine, FactorCache* cache)
 {
-	int threads = QThread::idealThreadCount();
-	if (threads == -1) threads = 2;
-	QImage ret(viewport, QImage::Format_Indexed8);
+	if (auto isolated = dynamic_cast<const IsolatedVm*>(vm))
+	{
+		return drawAllIsolated(isolated, rect, viewport);
+	}
+	if (!engine) engine = RenderEngine::instance();
+	auto math = dynamic_cast<MathVm*>(vm);
+	if (cache && math)
+	{
+		return drawCached(math, rect, viewport, engine, cache);
+	}
+	QImage ret = createImage(viewport);
 	qDebug() << "viewport: " << viewport;
-	ret.setColor(0, qRgb(255, 255, 255));
-	ret.setColor(1, qRgb(0, 0, 0));
-	ret.setColor(2, qRgb(255, 255, 0));
-	ret.fill(2);
-	QThreadPool pool;
-	pool.setMaxThreadCount(threads);
-	QRectF rect1(rect);
-	rect1.setHeight(rect1.height() / threads);
-	rect1.moveTop(rect1.top() + rect1.height() * (threads - 1));
-	QRect viewport1(QPoint(0, 0), viewport);
-	viewport1.setHeight(viewport1.height() / threads);
-	QAtomicPointer<Exception> e;
-	for (int i = 0; i < threads; ++i)
-	{
-		pool.start(new Task(&ret, rect1, viewport1, vm, &e));
-		qDebug() << "Started pool" << rect1 << viewport1;
-		rect1.moveTop(rect1.top() - rect1.height());
-		viewport1.moveTop(viewport1.top() + viewport1.height());
-	}
-	pool.waitForDone();
-	if (Exception *e0 = e.load())
-	{
-		Exception e1(*e0);
-		delete e0;
-		throw e1;
+	engine->run(bandJobs(engine, &ret, rect, vm));
+	return ret;
+}
+
+void finishFactorCache(FactorCache* cache)
+{
+	if (cache->fill)
+	{
+		cache->fill->engine->wait(cache->fill->batch);
+		cache->fill.reset();
 	}
+}
+
+QImage drawLattice(const PascalVm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine)
+{
+	if (!engine) engine = RenderEngine::instance();
+	QImage ret = createImage(viewport);
+	QImage *img = &ret;
+	engine->run(splitRows(engine, viewport.height(), [=](RenderSlot&, int top, int bottom)
+	{
+		renderLattice(img, rect, top, bottom, vm);
+	}));
 	return ret;
 }
 
-Task::Task(QImage* _img, const QRectF& _rect, const QRect& _viewport, Vm *_vm, QAtomicPointer<Exception>* _e):
-	img(_img), rect(_rect), viewport(_viewport), vm(_vm), e(_e)
+QImage drawCertified(const MathVm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine)
 {
+	if (!engine) engine = RenderEngine::instance();
+	QImage ret = createImage(viewport);
+	QImage *img = &ret;
+	/* Tiles are roots of the quadtree and jobs of the engine */
+	const int tile = 64;
+	std::vector<RenderEngine::Job> jobs;
+	for (int y = 0; y < viewport.height(); y += tile)
+	{
+		for (int x = 0; x < viewport.width(); x += tile)
+		{
+			int right = std::min(x + tile, viewport.width()), bottom = std::min(y + tile, viewport.height());
+			jobs.push_back([=](RenderSlot& slot)
+			{
+				Certifier(slot.getCtx(vm), vm, img, rect).cell(x, y, right, bottom);
+			});
+		}
+	}
+	engine->run(jobs);
+	return ret;
 }
 
-void Task::run()
+CurveRuns drawRuns(const Vm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine)
 {
-	float_t dx = static_cast<float_t>(rect.width()) / viewport.width(),
-	        dy = static_cast<float_t>(rect.height()) / viewport.height(),
-			y = rect.bottom(),
-			x = 0;
-	int pxEnd = viewport.right() + 1, pyEnd = viewport.bottom() + 1;
-	std::unique_ptr<Ctx> ctx(vm->createCtx());
-	qDebug() << viewport.top() << pyEnd;
-	for (int py = viewport.top(); py != pyEnd; ++py, y -= dy)
-	{
-		x = rect.left();
-		uchar *line = img->scanLine(py);
-		ctx->setVar('y', Real(y, y + dy));
-		for (int px = 0; px != pxEnd; ++px, x += dx)
+	if (!engine) engine = RenderEngine::instance();
+	/* Every band keeps one row of pixels and the runs of its rows */
+	int width = viewport.width(), height = viewport.height(), count = std::min(4 * engine->threadCount(), height);
+	std::vector<CurveRuns> bands(count, CurveRuns(width));
+	std::vector<RenderEngine::Job> jobs;
+	for (int i = 0; i < count; ++i)
+	{
+		CurveRuns *band = &bands[i];
+		int top = height * i / count, bottom = height * (i + 1) / count;
+		jobs.push_back([=](RenderSlot& slot)
+		{
+			Ctx *ctx = slot.getCtx(vm);
+			const Real *xs = columns(rect, width, slot.scratch);
+			RowProgram program(vm, rect, viewport, top, bottom);
+			std::unique_ptr<Scanline> scanline(program.scanline());
+			std::vector<uchar> line(width);
+			for (int py = top; py != bottom; ++py)
+			{
+				renderRow(ctx, program.vm, xs, width, rect, height, py, line.data(), scanline.get());
+				band->addRow(line.data());
+			}
+		});
+	}
+	engine->run(jobs);
+
+	CurveRuns ret(width);
+	for (auto& band : bands)
+	{
+		ret.append(band);
+	}
+	return ret;
+}
+
+void drawSweep(Vm* vm, const QRectF& rect, const QSize& viewport,
+	char param, real_t from, real_t to, int frames, const QString& dir)
+{
+	if (frames < 1)
+	{
+		throw Exception("Frame count must be positive");
+	}
+	if (dynamic_cast<const IsolatedVm*>(vm))
+	{
+		throw Exception("Native code has no parameters to sweep");
+	}
+	RenderEngine *engine = RenderEngine::instance();
+	/* Every frame is split into the same bands. Their programs are specialized to the whole range
+	 * of the parameter, so they are made once for the sweep */
+	auto xs = std::make_shared<std::vector<Real>>();
+	columns(rect, viewport.width(), *xs);
+	std::vector<std::pair<int, int>> bands = bandRows(engine, viewport.height());
+	std::vector<std::shared_ptr<RowProgram>> programs;
+	for (auto& rows : bands)
+	{
+		programs.emplace_back(new RowProgram(vm, rect, viewport, rows.first, rows.second,
+			param, Real(std::min(from, to), std::max(from, to))));
+	}
+	/* Bands of several frames are queued at once, so the workers stay busy
+	 * while finished frames are saved. The number of frames kept in memory is bounded. */
+	size_t maxInFlight = 2 * engine->threadCount();
+	std::deque<Frame> pending;
+	try
+	{
+		for (int i = 0; i < frames; ++i)
+		{
+			if (pending.size() >= maxInFlight)
+			{
+				saveFrame(engine, pending.front());
+				pending.pop_front();
+			}
+			real_t t = frames == 1 ? from : from + (to - from) * i / (frames - 1);
+			pending.emplace_back();
+			Frame& frame = pending.back();
+			frame.img = createImage(viewport);
+			frame.fileName = frameName(dir, i);
+			QImage *img = &frame.img;
+			std::vector<RenderEngine::Job> jobs;
+			for (size_t b = 0; b < bands.size(); ++b)
+			{
+				int top = bands[b].first, bottom = bands[b].second;
+				std::shared_ptr<RowProgram> program = programs[b];
+				jobs.push_back([=](RenderSlot& slot)
+				{
+					renderBand(slot, img, rect, top, bottom, vm, *program, xs->data(), param, t);
+				});
+			}
+			frame.batch = engine->submit(jobs);
+			qDebug() << "Started frame" << i << param << double(t);
+		}
+		while (!pending.empty())
+		{
+			saveFrame(engine, pending.front());
+			pending.pop_front();
+		}
+	}
+	catch (Exception)
+	{
+		/* Workers may still be drawing into the pending frames */
+		for (auto& frame : pending)
 		{
-			ctx->setVar('x', Real(x, x + dx));
-			ctx->reset();
 			try
 			{
-				Real res = vm->execute(&*ctx);
-				line[px] = res.isZero();
+				engine->wait(frame.batch);
 			}
-			catch (Exception e0)
+			catch (Exception)
 			{
-				e0.append(QString("Point: (%1, %2)").arg(double(x)).arg(double(y)));
-				delete e->fetchAndStoreOrdered(new Exception(e0));
-				return;
 			}
 		}
+		throw;
 	}
 }
@@ -0,0 +1,188 @@
+#include "gdrawer.hpp"
+#include <QThread>
+#include <QElapsedTimer>
+#include <QDebug>
+
+#if defined(Q_OS_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct RenderEngine::Batch
+{
+	int remaining;
+	std::unique_ptr<Exception> error;
+	Batch(int _remaining): remaining(_remaining) {}
+};
+
+class RenderEngine::Worker : public QThread
+{
+	public:
+		Worker(RenderEngine* _engine, int _index): engine(_engine), index(_index) {}
+	protected:
+		void run();
+	private:
+		RenderEngine *engine;
+		int index;
+		RenderSlot slot;
+};
+
+Ctx* RenderSlot::getCtx(const Vm* vm)
+{
+	if (!ctx || !vm->reuseCtx(&*ctx))
+	{
+		ctx.reset(vm->createCtx());
+	}
+	return &*ctx;
+}
+
+RenderEngine::RenderEngine(int threads): stopping(false), ready(0), startupNs(0)
+{
+	QElapsedTimer timer;
+	timer.start();
+	if (threads <= 0) threads = QThread::idealThreadCount();
+	if (threads <= 0) threads = 2;
+	for (int i = 0; i < threads; ++i)
+	{
+		workers.emplace_back(new Worker(this, i));
+		workers.back()->start();
+	}
+	QMutexLocker lock(&mutex);
+	while (ready != threads)
+	{
+		started.wait(&mutex);
+	}
+	startupNs = timer.nsecsElapsed();
+	qDebug() << "Render engine started" << threads << "workers in" << startupNs << "ns";
+}
+
+RenderEngine::~RenderEngine()
+{
+	shutdown();
+}
+
+RenderEngine* RenderEngine::instance()
+{
+	static RenderEngine engine;
+	return &engine;
+}
+
+qint64 RenderEngine::shutdown()
+{
+	QElapsedTimer timer;
+	timer.start();
+	{
+		QMutexLocker lock(&mutex);
+		stopping = true;
+		hasWork.wakeAll();
+	}
+	for (auto& w : workers)
+	{
+		w->wait();
+	}
+	workers.clear();
+	return timer.nsecsElapsed();
+}
+
+std::shared_ptr<RenderEngine::Batch> RenderEngine::submit(std::vector<Job> jobs)
+{
+	std::shared_ptr<Batch> batch(new Batch(jobs.size()));
+	QMutexLocker lock(&mutex);
+	if (stopping)
+	{
+		throw Exception("Render engine is stopped");
+	}
+	for (auto& job : jobs)
+	{
+		queue.emplace_back(std::move(job), batch);
+	}
+	hasWork.wakeAll();
+	return batch;
+}
+
+void RenderEngine::wait(const std::shared_ptr<Batch>& batch)
+{
+	QMutexLocker lock(&mutex);
+	while (batch->remaining)
+	{
+		batchDone.wait(&mutex);
+	}
+	if (batch->error)
+	{
+		throw Exception(*batch->error);
+	}
+}
+
+void RenderEngine::run(std::vector<Job> jobs)
+{
+	wait(submit(std::move(jobs)));
+}
+
+void RenderEngine::work(RenderSlot& slot)
+{
+	QMutexLocker lock(&mutex);
+	++ready;
+	started.wakeAll();
+	for (;;)
+	{
+		while (queue.empty() && !stopping)
+		{
+			hasWork.wait(&mutex);
+		}
+		if (queue.empty())
+		{
+			return;
+		}
+		Job job = std::move(queue.front().first);
+		std::shared_ptr<Batch> batch = std::move(queue.front().second);
+		queue.pop_front();
+
+		/* Once a job of the batch has failed the rest are only counted off */
+		if (!batch->error)
+		{
+			lock.unlock();
+			std::unique_ptr<Exception> error;
+			try
+			{
+				job(slot);
+			}
+			catch (Exception e)
+			{
+				error.reset(new Exception(e));
+			}
+			lock.relock();
+			if (error && !batch->error)
+			{
+				batch->error = std::move(error);
+			}
+		}
+		if (!--batch->remaining)
+		{
+			batchDone.wakeAll();
+		}
+	}
+}
+
+void RenderEngine::Worker::run()
+{
+#if defined(Q_OS_LINUX)
+	/* Pin the worker to the index-th CPU this process is allowed to run on */
+	cpu_set_t allowed;
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed) && CPU_COUNT(&allowed) > 0)
+	{
+		int n = index % CPU_COUNT(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed) && !n--)
+			{
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(cpu, &set);
+				pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+				break;
+			}
+		}
+	}
+#endif
+	engine->work(slot);
+}
@@ -0,0 +1,84 @@
+#include "gdrawer.hpp"
+#include <QDebug>
+
+namespace
+{
+	/* Sets hits[i] when the value of cells[i] may contain zero */
+	void evaluate(RenderEngine* engine, const Vm* vm, const std::vector<QRectF>& cells, std::vector<char>& hits)
+	{
+		hits.assign(cells.size(), 0);
+		int chunks = std::min<int>(4 * engine->threadCount(), cells.size());
+		std::vector<RenderEngine::Job> jobs;
+		for (int i = 0; i < chunks; ++i)
+		{
+			size_t begin = cells.size() * i / chunks, end = cells.size() * (i + 1) / chunks;
+			jobs.push_back([=, &cells, &hits](RenderSlot& slot)
+			{
+				Ctx *ctx = slot.getCtx(vm);
+				for (size_t j = begin; j != end; ++j)
+				{
+					const QRectF& c = cells[j];
+					ctx->setVar('x', Real(c.left(), c.right()));
+					ctx->setVar('y', Real(c.top(), c.bottom()));
+					ctx->reset();
+					try
+					{
+						hits[j] = vm->execute(ctx).isZero();
+					}
+					catch (Exception)
+					{
+						/* Cannot rule the cell out */
+						hits[j] = 1;
+					}
+				}
+			});
+		}
+		engine->run(jobs);
+	}
+}
+
+QRectF fitViewport(const Vm* vm, const QRectF& world, int budget)
+{
+	RenderEngine *engine = RenderEngine::instance();
+	std::vector<QRectF> cells(1, world), next;
+	std::vector<char> hits;
+	QRectF box;
+	for (;;)
+	{
+		evaluate(engine, vm, cells, hits);
+		budget -= cells.size();
+		next.clear();
+		box = QRectF();
+		for (size_t i = 0; i < cells.size(); ++i)
+		{
+			if (hits[i])
+			{
+				next.push_back(cells[i]);
+				box = box.isNull() ? cells[i] : box.united(cells[i]);
+			}
+		}
+		if (next.empty())
+		{
+			return QRectF();
+		}
+		/* Stop when the cells are small enough to outline the curve, or when the next level is over budget */
+		const QRectF& cell = next.front();
+		if ((cell.width() < box.width() / 256 && cell.height() < box.height() / 256)
+			|| int(4 * next.size()) > budget)
+		{
+			break;
+		}
+		cells.clear();
+		for (auto& c : next)
+		{
+			qreal w = c.width() / 2, h = c.height() / 2;
+			cells.emplace_back(c.left(), c.top(), w, h);
+			cells.emplace_back(c.left() + w, c.top(), w, h);
+			cells.emplace_back(c.left(), c.top() + h, w, h);
+			cells.emplace_back(c.left() + w, c.top() + h, w, h);
+		}
+	}
+	qDebug() << "Fitted viewport" << box << "cells" << next.size() << "budget left" << budget;
+	qreal margin = std::max(box.width(), box.height()) / 20;
+	return box.adjusted(-margin, -margin, margin, margin);
+}
@@ -4,12 +4,20 @@
 #include <memory>
 #include <vector>
 #include <array>
+#include <deque>
+#include <list>
+#include <map>
+#include <functional>
 #include <ctype.h>
 #include <QString>
+#include <QStringList>
 #include <QWidget>
 #include <QImage>
 #include <cmath>
 #include <QComboBox>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QMap>
 
 typedef double real_t;
 
@@ -55,14 +63,31 @@ struct RangeReal
 		{
 			throw Exception("Division by zero");
 		}
+		return divide(other);
+	}
+	/* Division by an interval which is known not to contain zero */
+	RangeReal divide(const RangeReal& other) const
+	{
 		real_t a = min / other.min, b = min / other.max,
 			   c = max / other.min, d = max / other.max;
 		return RangeReal(std::min({a, b, c, d}), std::max({a, b, c, d}));
 	}
+	/* Squares are never negative, unlike products of an interval around zero with itself */
+	RangeReal square() const
+	{
+		real_t low = std::max({real_t(0), min, -max});
+		return RangeReal(low * low, std::max(min * min, max * max));
+	}
 	RangeReal pow(const RangeReal& other) const
 	{
 		if (min <= EPS && max >= -EPS)
 		{
+			/* Odd powers keep the sign */
+			int o = other.max;
+			if (other.min == other.max && o > 0 && o % 2 && std::fabs(other.max - o) < EPS)
+			{
+				return RangeReal(std::pow(min, o), std::pow(max, o));
+			}
 			return RangeReal(0, std::pow(std::max(-min, max), other.max));
 		}
 		else if (max >= 0)
@@ -105,6 +130,11 @@ struct RangeReal
 	{
 		return min <= EPS && max >= -EPS;
 	}
+	/* Without the tolerance of isZero() */
+	bool containsZero() const
+	{
+		return min <= 0 && max >= 0;
+	}
 };
 
 typedef RangeReal Real;
@@ -119,18 +149,31 @@ struct Ctx
 struct Vm
 {
 	virtual Ctx *createCtx() const = 0;
+	/* Prepares a context created by another Vm for use with this one, returns false if it does not fit */
+	virtual bool reuseCtx(Ctx*) const { return false; }
 
 	virtual Real execute(Ctx* ctx) const = 0;
 	virtual ~Vm() {}
 };
 
+/* Interval value of a function and of its partial derivatives by x and y */
+struct Dual
+{
+	Real v, x, y;
+};
+
 struct MathCtx : Ctx
 {
 	std::unique_ptr<Real[]> origStack;
+	/* Stack of MathVm::executeGrad() */
+	std::unique_ptr<Dual[]> gradStack;
 	std::array<Real, 26> vars;
+	/* Values which P instructions load, see Scanline */
+	const Real *polys;
 	Real *stack;
+	int stackSize;
 
-	MathCtx(int stackSize): origStack(new Real[stackSize]), stack(origStack.get()) {}
+	MathCtx(int _stackSize): origStack(new Real[_stackSize]), gradStack(new Dual[_stackSize]), polys(NULL), stack(origStack.get()), stackSize(_stackSize) {}
 	void reset() { stack = origStack.get(); }
 	inline void push(const Real& val)
 	{
@@ -159,21 +202,123 @@ struct Instr
 	char type;
 	char arg;
 	real_t val;
+	/* Source of the subexpression which emitted the instruction, byte offsets into the formula or -1 */
+	int begin, end;
+
+	Instr(char _type, char _arg = 0, real_t _val = 0, int _begin = -1, int _end = -1):
+		type(_type), arg(_arg), val(_val), begin(_begin), end(_end) {}
+};
+
+/* Execution counts of every instruction and cycles spent in them, see MathVm::profile() */
+struct Profile
+{
+	std::vector<quint64> counts, cycles;
+	/* Cycles are measured in every sampleRate-th run only */
+	quint64 runs, sampledRuns;
+	static const int sampleRate = 16;
+	Profile(): runs(0), sampledRuns(0) {}
+	void merge(const Profile& other);
+};
+
+struct JitCode;
+/* Returns zero and leaves the result in stack[0] on success */
+int runJit(const JitCode* code, Real* stack, const Real* vars, const Real* polys);
 
-	Instr(char _type, char _arg = 0, real_t _val = 0): type(_type), arg(_arg), val(_val) {}
+/* Polynomial in x and y, see scanline.cpp */
+struct Polynomial
+{
+	int degreeX, degreeY;
+	/* Coefficient of x^i y^j is coeffs[i * (degreeY + 1) + j] */
+	std::vector<real_t> coeffs;
+	Polynomial(real_t c = 0): degreeX(0), degreeY(0), coeffs(1, c) {}
+	real_t at(int i, int j) const { return i <= degreeX && j <= degreeY ? coeffs[i * (degreeY + 1) + j] : 0; }
 };
 
 struct MathVm : Vm, std::vector<Instr>
 {
 	int requiredStackSize;
+	/* Code of the factors of a top-level product, if there are several. link() chains them so
+	 * that evaluation stops at the first factor which contains zero, see Real::containsZero() */
+	std::vector<std::vector<Instr>> factors;
+	void link();
+	/* Reorders the factors by their cost and by how often they contain zero over rect */
+	void calibrate(const QRectF& rect);
 	Ctx* createCtx() const { return new MathCtx(requiredStackSize); }
+	bool reuseCtx(Ctx* ctx) const;
 	Real execute(Ctx* ctx) const;
+	/* Also computes the partial derivatives over the cell by forward differentiation. Factors do not
+	 * stop the evaluation, the derivatives are the ones of the whole product */
+	Real executeGrad(Ctx* ctx, Real* dx, Real* dy) const;
+	/* Runs the interpreter and accounts every instruction in profile */
+	Real profile(Ctx* ctx, Profile& out) const;
 	static Vm *get(const QString& expr);
+	/* Compiled formula files, see bytecode.cpp. load() rejects files compiled from a source
+	 * other than the given one, unless source is null */
+	void save(const QString& filename, const QString& source) const;
+	static MathVm* load(const QString& filename, const QString& source = QString());
+	static quint64 sourceHash(const QString& source);
+	/* Equal for factors compiled from the same expression */
+	static quint64 codeHash(const std::vector<Instr>& code);
+	/* The code with its polynomial subtrees replaced by P instructions, which load their values over rows
+	 * of pixels from a Scanline. Null if there are none or GDRAWER_SCANLINE is not set, see scanline.cpp */
+	std::shared_ptr<MathVm> scanline;
+	/* The polynomials which P instructions of this code load, P loads the value of polys[val] */
+	std::vector<Polynomial> polys;
+	void findPolynomials();
+	/* A copy of the code whose instructions are specialized to what they get while the variables stay
+	 * within the given ranges. Null if nothing can be specialized, see specialize.cpp */
+	std::shared_ptr<MathVm> specialize(const std::array<Real, 26>& vars) const;
+	/* Native code for the instructions, see jit.cpp. Null where there is no code generator */
+	std::shared_ptr<JitCode> jit;
+	void compile();
+	/* Both throw unless the bytecode is well-formed, verify() also checks that it fits into requiredStackSize */
+	static void stackEffect(const Instr& i, int* needs, int* pushes);
+	int stackDepth() const;
+	void verify() const;
 	void dump();
 };
 
+/* Values of the polynomials of a scanline program over the pixels left + px * dx of a row,
+ * advanced from pixel to pixel by forward differences */
+class Scanline
+{
+	public:
+		Scanline(const MathVm* program, real_t left, real_t dx);
+		/* Starts the row at pixel 0 and points ctx at the values */
+		void beginRow(MathCtx* ctx, const Real& y);
+		void nextPixel();
+
+	private:
+		struct Row
+		{
+			/* The differences are computed again every segment pixels and where x changes its sign */
+			int degree, segment, nextSeed;
+			/* Coefficients of the Taylor coefficients T_k of the midpoints and the radii over the row, and of |T_k|
+			 * of the midpoints, from offsets[k] on. growth[k] bounds the rounding errors of the differences of T_k */
+			std::vector<int> offsets;
+			std::vector<real_t> mid, rad, bound, growth;
+			/* Forward differences of T_k of the midpoints and the radii, bounds[k] is their rounding error */
+			std::vector<std::pair<real_t, real_t>> diffs;
+			std::vector<real_t> bounds;
+		};
+		const MathVm *program;
+		real_t left, dx;
+		/* Powers of dx */
+		std::vector<real_t> steps;
+		std::vector<Row> rows;
+		std::vector<Real> values;
+		/* positive is the first pixel from which x is not negative */
+		int px, positive;
+		void seed(Row& row);
+		void advance(Row& row);
+		Real value(const Row& row) const;
+};
+
 struct expr_t
 {
+	/* Byte offsets of the subexpression in the formula, set by the parser */
+	int begin, end;
+	expr_t(): begin(-1), end(-1) {}
 	virtual int getDepth() const = 0;
 	virtual void addInstr(MathVm* instrs) const = 0;
 	virtual ~expr_t() {}
@@ -205,7 +350,15 @@ struct binop_t : expr_t
 {
 	char op;
 	std::unique_ptr<expr_t> l, r;
-	binop_t(char _op, expr_t* _l, expr_t* _r = NULL): op(_op), l(_l), r(_r) {}
+	binop_t(char _op, expr_t* _l, expr_t* _r = NULL): op(_op), l(_l), r(_r)
+	{
+		/* Inner links of a chain like a * b * c are not rules of their own */
+		if (r)
+		{
+			begin = l->begin;
+			end = r->end;
+		}
+	}
 	int getDepth() const { return 1 + std::max(l->getDepth(), r->getDepth()); }
 	void addInstr(MathVm* instrs) const;
 	bool equalsTo(const expr_t* other) const;
@@ -223,10 +376,33 @@ struct unop_t : expr_t
 	char opcode() const { return op == '-' ? 'm' : op; }
 };
 
+/* Collects the factors of a chain of multiplications */
+void splitProduct(const expr_t* e, std::vector<const expr_t*>& factors);
+
 class QLabel;
+class QCheckBox;
 class QLineEdit;
 class QTextEdit;
 class QCloseEvent;
+class QFileSystemWatcher;
+class QTimer;
+
+struct FactorFill;
+
+/* Whether every factor of the last rendered formula contains zero at each pixel, and how far from zero it is
+ * otherwise, one byte per pixel. Kept between renders of the same rect, so that after an edit only the changed
+ * factors are evaluated. The first render of a rect fills them afterwards, see drawFormula() */
+struct FactorCache
+{
+	QRectF rect;
+	QSize viewport;
+	/* Number of bands the rows were split into, the values depend on the programs of the bands */
+	int bands;
+	std::map<quint64, std::shared_ptr<std::vector<uchar>>> factors;
+	/* Jobs which are still filling the states */
+	std::shared_ptr<FactorFill> fill;
+	FactorCache(): bands(0) {}
+};
 
 class MainWindow : public QWidget
 {
@@ -234,17 +410,31 @@ class MainWindow : public QWidget
 	private:
 		QLabel *picture;
 		QLineEdit *x1, *y1, *x2, *y2;
+		QLineEdit *param, *paramFrom, *paramTo, *frames;
 		QLabel *pathLabel;
 		QString path;
 		void resetRect();
-		QString getFormula(const QString& filename);
+		QString getFormula(const QString& filename, bool* hasRect = NULL);
+		Vm* loadVm(QRectF* rect);
 		QComboBox *type;
+		QCheckBox *isolate, *lattice, *certify;
+		bool needFit, fitRequested;
+		FactorCache cache;
+		/* Redraws when the file changes on disk, several changes in a row cause one redraw */
+		QFileSystemWatcher *watcher;
+		QTimer *redrawTimer;
+
+	private slots:
+		void fileChanged(const QString& path);
 
 	public slots:
 		void open();
 		void open(QString path);
 		void draw();
 		void view();
+		void sweep();
+		void fit();
+		void profile();
 
 	public:
 		MainWindow();
@@ -271,13 +461,75 @@ class FileEditor : public QWidget
 		FileEditor(const QString& _path);
 };
 
-QImage drawFormula(Vm* vm, const QRectF& rect, const QSize& viewport);
+/* Per-worker state which outlives a single render */
+struct RenderSlot
+{
+	std::unique_ptr<Ctx> ctx;
+	std::vector<Real> scratch;
+	Ctx* getCtx(const Vm* vm);
+};
+
+/* Long-lived pool of pinned render threads, shared by all renders */
+class RenderEngine
+{
+	public:
+		typedef std::function<void(RenderSlot&)> Job;
+		struct Batch;
+
+		RenderEngine(int threads = 0);
+		~RenderEngine();
+		static RenderEngine* instance();
+
+		std::shared_ptr<Batch> submit(std::vector<Job> jobs);
+		/* Waits for all jobs of the batch and rethrows the first exception thrown by them */
+		void wait(const std::shared_ptr<Batch>& batch);
+		void run(std::vector<Job> jobs);
+
+		int threadCount() const { return workers.size(); }
+		qint64 startupTime() const { return startupNs; }
+		/* Stops the workers, returns the time it took in ns */
+		qint64 shutdown();
+
+	private:
+		class Worker;
+		QMutex mutex;
+		QWaitCondition hasWork, batchDone, started;
+		std::deque<std::pair<Job, std::shared_ptr<Batch>>> queue;
+		std::vector<std::unique_ptr<Worker>> workers;
+		bool stopping;
+		int ready;
+		qint64 startupNs;
+		void work(RenderSlot& slot);
+};
+
+/* With a cache, only the factors of a formula which are not in it are evaluated. The picture is the same
+ * as without it. A rect other than the cached one is rendered without the cache and becomes the cached one,
+ * the engine fills the states of its factors after returning. The next render stops that */
+QImage drawFormula(Vm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine = NULL,
+	FactorCache* cache = NULL);
+/* Waits until the states of the last render are filled */
+void finishFactorCache(FactorCache* cache);
+/* Subdivides the picture like a quadtree. Cells where the formula is monotone in x or in y have one crossing
+ * per row or column, which is found by bisection instead of evaluating every pixel. Draws a subset of the
+ * pixels drawFormula() draws, leaving out the ones the derivatives rule out */
+QImage drawCertified(const MathVm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine = NULL);
+/* Finds the bounding box of the curve inside world by subdividing the cells whose value may contain zero,
+ * using about budget evaluations. Needs a Vm which evaluates whole intervals. Returns a null rect if there is no curve */
+QRectF fitViewport(const Vm* vm, const QRectF& world = QRectF(-1000, -1000, 2000, 2000), int budget = 1 << 18);
+/* Renders frames with param running from `from` to `to`, saving frame i to dir/frameNNNN.png. Native code
+ * has no parameters and is rejected */
+void drawSweep(Vm* vm, const QRectF& rect, const QSize& viewport,
+	char param, real_t from, real_t to, int frames, const QString& dir);
 
 struct PascalCtx : Ctx
 {
 	double x, y;
 	void reset() {} 
-	void setVar(char name, Real value) { (name == 'x' ? x : y) = value.min; }
+	void setVar(char name, Real value)
+	{
+		if (name == 'x') x = value.min;
+		else if (name == 'y') y = value.min;
+	}
 };
 
 struct PascalVm : Vm
@@ -285,11 +537,144 @@ struct PascalVm : Vm
 	void *lib;
 	char (*fn)(double, double);
 	Ctx *createCtx() const { return new PascalCtx; }
+	bool reuseCtx(Ctx* ctx) const { return dynamic_cast<PascalCtx*>(ctx) != NULL; }
 	Real execute(Ctx*) const;
 	~PascalVm();
 };
 
-Vm* getPascalVm(const QString& program);
-Vm* getCppVm(const QString& program);
+/* Curve pixels of a render as runs of every row, see runs.cpp. Set operations take time proportional
+ * to the number of runs, not to the area of the picture */
+struct CurveRuns
+{
+	struct Run
+	{
+		qint32 begin, end;
+	};
+	int width, height;
+	std::vector<Run> runs;
+	/* Runs of row y are runs[rows[y]] up to runs[rows[y + 1]] */
+	std::vector<quint32> rows;
+
+	CurveRuns(int _width = 0);
+	static CurveRuns fromImage(const QImage& img);
+	QImage toImage() const;
+	/* Appends a row of pixel values, where 1 is the curve */
+	void addRow(const uchar* line);
+	void append(const CurveRuns& other);
+	qint64 count() const;
+	/* All of them throw unless both renders have the same size */
+	CurveRuns unite(const CurveRuns& other) const;
+	CurveRuns subtract(const CurveRuns& other) const;
+	CurveRuns symmetricDifference(const CurveRuns& other) const;
+	/* Adds every pixel within radius pixels horizontally and vertically, to compare with a tolerance */
+	CurveRuns dilate(int radius) const;
+	void save(const QString& filename) const;
+	static CurveRuns load(const QString& filename);
+};
+
+/* Renders straight into runs, without a picture */
+CurveRuns drawRuns(const Vm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine = NULL);
+int runSaveRuns(const QStringList& args);
+int runDiff(const QStringList& args);
+
+/* Profiles the interpreter over every pixel and reports the cost of the lines and subexpressions of source */
+Profile profileFormula(const MathVm* vm, const QRectF& rect, const QSize& viewport);
+QString profileReport(const MathVm* vm, const Profile& profile, const QString& source,
+	const std::vector<int>& lines = std::vector<int>());
+
+/* Samples native code at the corners of the pixels instead of one point per pixel and marks
+ * the pixels whose corners differ, that is the boundary of the set where it returns true */
+QImage drawLattice(const PascalVm* vm, const QRectF& rect, const QSize& viewport, RenderEngine* engine = NULL);
+
+/* lines receives the line of the file for every byte of the UTF-8 formula */
+QString readFormula(const QString& filename, QStringList* rect = NULL, std::vector<int>* lines = NULL);
+QString readFile(const QString& filename);
+
+class QLocalServer;
+class QTcpServer;
+class QIODevice;
+class QThreadPool;
+
+/* Resident render service, see server.cpp for the protocol. Compiled Vms are kept in an LRU cache,
+ * requests are handled concurrently and all of them render on the shared RenderEngine */
+class RenderServer : public QObject
+{
+	Q_OBJECT
+	private:
+		QLocalServer *server;
+		QTcpServer *tcpServer;
+		/* Clients connected over TCP may be on other hosts */
+		QMap<quint64, QIODevice*> clients;
+		QMap<quint64, bool> remote;
+		/* Requests of every client which have not been replied to */
+		QMap<quint64, int> pending;
+		/* Remote requests run here, a few at a time */
+		QThreadPool *remotePool;
+		QMutex cacheMutex;
+		std::list<std::pair<QString, std::shared_ptr<Vm>>> cache;
+		int cacheSize;
+		quint64 lastClient;
+		void addClient(QIODevice* socket, bool isRemote);
+		void read(quint64 client);
+		/* With compiled, source is a .gdvm file to load */
+		std::shared_ptr<Vm> getVm(const QString& backend, const QString& source, bool isolated, bool compiled,
+			const QRectF& rect, bool* cached);
+
+	private slots:
+		void accept();
+		void acceptTcp();
+		void send(quint64 client, QByteArray reply);
+
+	public:
+		RenderServer(int _cacheSize = 32);
+		/* A name with a colon is a host:port to listen on over TCP, otherwise a local server name.
+		 * Without a host, as in ":port", only this host can connect */
+		bool listen(const QString& name);
+		/* Handles a request line, returns the reply line. Remote requests may only draw formulas
+		 * given inline and smaller pictures, as they can neither run native code nor touch files. Thread-safe */
+		QByteArray handle(const QByteArray& line, bool isRemote = false);
+};
+
+int runRenderClient(const QString& name, const QString& request);
+
+/* Connects to a render server given as in RenderServer::listen(), null on errors */
+QIODevice* connectToServer(const QString& name, int timeout, QString* error);
+
+struct ClusterStats
+{
+	int tiles, retries;
+	qint64 ms;
+	/* Tiles rendered by every worker */
+	QMap<QString, int> done;
+	ClusterStats(): tiles(0), retries(0), ms(0) {}
+};
+
+/* Splits rect into tiles and renders them on render servers, see cluster.cpp. Failed tiles are
+ * retried on any worker, the render throws when a tile fails too often or every worker is lost */
+QImage drawDistributed(const QStringList& workers, const QString& backend, const QString& source,
+	const QRectF& rect, const QSize& viewport, int tileSize = 256, ClusterStats* stats = NULL);
+int runCoordinator(const QStringList& args);
+
+/* Checks of the renderer, see selftest.cpp */
+int runSelfTest();
+
+/* A compiled native submission which is never loaded into this process, see isolate.cpp */
+struct IsolatedVm : Vm
+{
+	QString lib, symbol;
+	IsolatedVm(const QString& _lib, const QString& _symbol): lib(_lib), symbol(_symbol) {}
+	Ctx *createCtx() const { return new PascalCtx; }
+	Real execute(Ctx*) const;
+};
+
+/* Renders in worker processes, giving up on a tile after tileTimeout ms. Tiles which could not be
+ * rendered are left unfilled and described in errors */
+QImage drawIsolated(const IsolatedVm* vm, const QRectF& rect, const QSize& viewport,
+	int tileTimeout = 5000, QStringList* errors = NULL);
+int runIsolatedWorker(const QString& lib, const QString& symbol);
+
+Vm* createVm(const QString lib, const char *fn);
+Vm* getPascalVm(const QString& program, bool isolated = false);
+Vm* getCppVm(const QString& program, bool isolated = false);
 
 #endif
@@ -0,0 +1,329 @@
+#include "gdrawer.hpp"
+#include <QCoreApplication>
+#include <QProcess>
+#include <QSharedMemory>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include <QThread>
+#include <QDebug>
+#include <iostream>
+#include <sstream>
+#include <cstring>
+
+/* Native submissions may crash or hang, so they can be run in worker processes instead of dlopen()ing them here.
+ * Every worker is a copy of gdrawer started as `gdrawer --isolated-worker lib symbol`. It talks a line protocol
+ * on stdin/stdout and renders tiles right into a shared memory image:
+ *   map <key> <width> <bytesPerLine> <height>          attach to the image, answers "ok"
+ *   tile <px> <py> <w> <h> <left> <bottom> <dx> <dy>   render a tile, answers "ok"
+ * The workers are supervised by a thread whose event loop sleeps until one of them answers, exits or runs out of time.
+ */
+
+namespace
+{
+	const int tileSize = 64;
+	const int maxAttempts = 2;
+
+	struct Worker
+	{
+		std::unique_ptr<QProcess> proc;
+		int tile;
+		QElapsedTimer timer;
+	};
+
+	void releaseImage(void* shm)
+	{
+		delete static_cast<QSharedMemory*>(shm);
+	}
+
+	QString tileName(const QRect& tile)
+	{
+		return QString("(%1, %2) %3x%4").arg(tile.left()).arg(tile.top()).arg(tile.width()).arg(tile.height());
+	}
+
+	bool readAnswer(QProcess* proc, int timeout)
+	{
+		QElapsedTimer timer;
+		timer.start();
+		while (!proc->canReadLine())
+		{
+			if (proc->state() != QProcess::Running || timer.elapsed() > timeout || !proc->waitForReadyRead(timeout))
+			{
+				return false;
+			}
+		}
+		return proc->readLine().trimmed() == "ok";
+	}
+
+	void startWorker(Worker& w, const IsolatedVm* vm, const QSharedMemory& shm, int width, int bytesPerLine, int height)
+	{
+		w.tile = -1;
+		w.proc.reset(new QProcess);
+		w.proc->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+		w.proc->start(QCoreApplication::applicationFilePath(),
+			QStringList() << "--isolated-worker" << vm->lib << vm->symbol);
+		if (!w.proc->waitForStarted())
+		{
+			throw Exception(QString("Cannot start a worker process: %1").arg(w.proc->errorString()));
+		}
+		w.proc->write(QString("map %1 %2 %3 %4\n").arg(shm.key()).arg(width).arg(bytesPerLine).arg(height).toUtf8());
+		if (!readAnswer(&*w.proc, 10000))
+		{
+			throw Exception("Worker process failed to load the submission");
+		}
+	}
+
+	void stopWorker(Worker& w)
+	{
+		w.proc->kill();
+		w.proc->waitForFinished();
+	}
+
+	/* Hands out the tiles of a picture in shared memory to the worker processes. The processes belong
+	 * to this thread, so its event loop serves nothing else while it waits for them */
+	class Supervisor : public QThread
+	{
+		public:
+			/* Set if the workers could not be run at all */
+			QString error;
+
+			Supervisor(const IsolatedVm* _vm, const QSharedMemory* _shm, const QRectF& _rect, const QSize& _viewport,
+				int _bytesPerLine, int _tileTimeout, QStringList* _errors):
+				vm(_vm), shm(_shm), rect(_rect), viewport(_viewport), bytesPerLine(_bytesPerLine),
+				tileTimeout(_tileTimeout), errors(_errors) {}
+
+		protected:
+			void run()
+			{
+				try
+				{
+					supervise();
+				}
+				catch (Exception e)
+				{
+					error = e.what();
+				}
+			}
+
+		private:
+			const IsolatedVm *vm;
+			const QSharedMemory *shm;
+			QRectF rect;
+			QSize viewport;
+			int bytesPerLine, tileTimeout;
+			QStringList *errors;
+
+			void supervise()
+			{
+				int width = viewport.width(), height = viewport.height();
+				std::vector<QRect> tiles;
+				for (int py = 0; py < height; py += tileSize)
+				{
+					for (int px = 0; px < width; px += tileSize)
+					{
+						tiles.emplace_back(px, py, std::min(tileSize, width - px), std::min(tileSize, height - py));
+					}
+				}
+				std::deque<int> todo;
+				for (size_t i = 0; i < tiles.size(); ++i)
+				{
+					todo.push_back(i);
+				}
+				std::vector<int> attempts(tiles.size());
+				real_t dx = rect.width() / width, dy = rect.height() / height;
+
+				/* Answers and exits of the workers and the nearest timeout wake the loop up */
+				QEventLoop loop;
+				QTimer timeout;
+				timeout.setSingleShot(true);
+				QObject::connect(&timeout, &QTimer::timeout, &loop, &QEventLoop::quit);
+				auto start = [&](Worker& w)
+				{
+					startWorker(w, vm, *shm, width, bytesPerLine, height);
+					QObject::connect(&*w.proc, &QProcess::readyRead, &loop, &QEventLoop::quit);
+					QObject::connect(&*w.proc, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+						&loop, &QEventLoop::quit);
+				};
+
+				int threads = QThread::idealThreadCount();
+				std::vector<Worker> workers(std::max(1, std::min<int>(threads, tiles.size())));
+				for (auto& w : workers)
+				{
+					start(w);
+				}
+
+				size_t finished = 0;
+				while (finished != tiles.size())
+				{
+					bool progress = false;
+					qint64 wait = tileTimeout;
+					for (auto& w : workers)
+					{
+						if (w.tile == -1 && !todo.empty())
+						{
+							w.tile = todo.front();
+							todo.pop_front();
+							const QRect& t = tiles[w.tile];
+							w.proc->write(QString("tile %1 %2 %3 %4 %5 %6 %7 %8\n")
+								.arg(t.left()).arg(t.top()).arg(t.width()).arg(t.height())
+								.arg(double(rect.left()), 0, 'g', 17).arg(double(rect.bottom()), 0, 'g', 17)
+								.arg(double(dx), 0, 'g', 17).arg(double(dy), 0, 'g', 17).toUtf8());
+							w.timer.start();
+						}
+						if (w.tile == -1)
+						{
+							continue;
+						}
+
+						if (w.proc->canReadLine())
+						{
+							w.proc->readLine();
+							w.tile = -1;
+							++finished;
+							progress = true;
+						}
+						else if (w.proc->state() != QProcess::Running)
+						{
+							/* The submission crashed: retry the tile in a fresh worker */
+							if (++attempts[w.tile] < maxAttempts)
+							{
+								todo.push_back(w.tile);
+							}
+							else
+							{
+								++finished;
+								if (errors) errors->append(QString("Tile %1 crashed the submission").arg(tileName(tiles[w.tile])));
+							}
+							start(w);
+							progress = true;
+						}
+						else if (w.timer.elapsed() > tileTimeout)
+						{
+							/* A hung tile is not retried, it would most likely hang again */
+							++finished;
+							if (errors) errors->append(QString("Tile %1 timed out").arg(tileName(tiles[w.tile])));
+							stopWorker(w);
+							start(w);
+							progress = true;
+						}
+						else
+						{
+							wait = std::min(wait, tileTimeout - w.timer.elapsed());
+						}
+					}
+					if (!progress)
+					{
+						timeout.start(int(std::max<qint64>(0, wait)) + 1);
+						loop.exec();
+						timeout.stop();
+					}
+				}
+				for (auto& w : workers)
+				{
+					w.proc->closeWriteChannel();
+					if (!w.proc->waitForFinished(1000))
+					{
+						stopWorker(w);
+					}
+				}
+			}
+	};
+}
+
+Real IsolatedVm::execute(Ctx*) const
+{
+	throw Exception("This submission can only be run in worker processes");
+}
+
+QImage drawIsolated(const IsolatedVm* vm, const QRectF& rect, const QSize& viewport, int tileTimeout, QStringList* errors)
+{
+	static QAtomicInt serial;
+	int width = viewport.width(), height = viewport.height(), bytesPerLine = (width + 3) & ~3;
+	std::unique_ptr<QSharedMemory> shm(new QSharedMemory(
+		QString("gdrawer-%1-%2").arg(QCoreApplication::applicationPid()).arg(serial.fetchAndAddOrdered(1))));
+	if (!shm->create(std::max(1, bytesPerLine * height)))
+	{
+		throw Exception(QString("Cannot create shared memory: %1").arg(shm->errorString()));
+	}
+	memset(shm->data(), 2, bytesPerLine * height);
+
+	Supervisor supervisor(vm, &*shm, rect, viewport, bytesPerLine, tileTimeout, errors);
+	supervisor.start();
+	supervisor.wait();
+	if (!supervisor.error.isNull())
+	{
+		throw Exception(supervisor.error);
+	}
+
+	/* The image lives in shared memory until the last copy of it is gone */
+	QImage ret(static_cast<uchar*>(shm->data()), width, height, bytesPerLine, QImage::Format_Indexed8, releaseImage, &*shm);
+	shm.release();
+	ret.setColor(0, qRgb(255, 255, 255));
+	ret.setColor(1, qRgb(0, 0, 0));
+	ret.setColor(2, qRgb(255, 255, 0));
+	return ret;
+}
+
+int runIsolatedWorker(const QString& lib, const QString& symbol)
+{
+	std::unique_ptr<Vm> vm;
+	try
+	{
+		vm.reset(createVm(lib, symbol.toUtf8().data()));
+	}
+	catch (Exception e)
+	{
+		std::cerr << e.what().toStdString() << std::endl;
+		return 1;
+	}
+	char (*fn)(double, double) = static_cast<PascalVm*>(&*vm)->fn;
+	QSharedMemory shm;
+	int width = 0, bytesPerLine = 0, height = 0;
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		std::istringstream s(line);
+		std::string cmd;
+		s >> cmd;
+		if (cmd == "map")
+		{
+			std::string key;
+			s >> key >> width >> bytesPerLine >> height;
+			if (shm.isAttached()) shm.detach();
+			shm.setKey(QString::fromStdString(key));
+			if (!shm.attach())
+			{
+				std::cerr << "Cannot attach to shared memory: " << shm.errorString().toStdString() << std::endl;
+				return 1;
+			}
+		}
+		else if (cmd == "tile")
+		{
+			int px, py, w, h;
+			double left, bottom, dx, dy;
+			s >> px >> py >> w >> h >> left >> bottom >> dx >> dy;
+			if (!shm.isAttached() || px < 0 || py < 0 || w < 0 || h < 0 || px + w > width || py + h > height)
+			{
+				std::cerr << "Invalid tile: " << line << std::endl;
+				return 1;
+			}
+			uchar *data = static_cast<uchar*>(shm.data());
+			for (int j = py; j != py + h; ++j)
+			{
+				uchar *out = data + j * bytesPerLine;
+				double y = bottom - j * dy;
+				for (int i = px; i != px + w; ++i)
+				{
+					out[i] = fn(left + i * dx, y) ? 1 : 0;
+				}
+			}
+		}
+		else
+		{
+			std::cerr << "Unknown command: " << line << std::endl;
+			return 1;
+		}
+		std::cout << "ok" << std::endl;
+	}
+	return 0;
+}
@@ -0,0 +1,428 @@
+#include "gdrawer.hpp"
+#include <QtGlobal>
+#include <QDebug>
+#include <cstring>
+
+/* Translates MathVm bytecode into x86-64 SSE2 code. The depth of the stack before every instruction is known
+ * at compile time, so the stack lives in registers: slot k is kept in xmm(4 + k), deeper slots in memory.
+ * The generated function is int f(Real* stack, const Real* vars, const Real* polys), following the System V
+ * calling convention: rbx = stack, r12 = vars, r13 = polys; slot k is spilled to [rbx + 16 * k] around calls and the result is left in stack[0]
+ * Division and exponentiation call back into RangeReal. The function returns 1 when RangeReal threw,
+ * then MathVm::execute reruns the interpreter to throw it. */
+
+#if defined(Q_PROCESSOR_X86_64) && (defined(Q_OS_LINUX) || defined(Q_OS_OSX))
+#define GDRAWER_JIT
+#include <sys/mman.h>
+#endif
+
+struct JitCode
+{
+	void *mem;
+	size_t size;
+	int (*fn)(Real*, const Real*, const Real*);
+	JitCode(): mem(NULL), size(0), fn(NULL) {}
+	~JitCode()
+	{
+#ifdef GDRAWER_JIT
+		if (mem) munmap(mem, size);
+#endif
+	}
+};
+
+int runJit(const JitCode* code, Real* stack, const Real* vars, const Real* polys)
+{
+	return code->fn(stack, vars, polys);
+}
+
+#ifdef GDRAWER_JIT
+
+static_assert(sizeof(Real) == 16, "Real must be two packed doubles");
+
+namespace
+{
+	int jitCall(Real* slot, int type)
+	{
+		try
+		{
+			switch (type)
+			{
+				case '/': slot[0] = slot[0] / slot[1]; break;
+				case '^': slot[0] = slot[0].pow(slot[1]); break;
+				default: return 1;
+			}
+		}
+		catch (Exception)
+		{
+			return 1;
+		}
+		return 0;
+	}
+
+	enum { RBX = 3, R12 = 12, R13 = 13 };
+	/* Stack slots kept in registers */
+	const int regSlots = 12;
+
+	class Assembler
+	{
+		public:
+			std::vector<quint8> code;
+			/* Positions of rel32 fields which jump to the epilogue, to the successful exit which clears eax first,
+			 * and to the error exit */
+			std::vector<size_t> toEnd, toSuccess, toError;
+
+			void byte(quint8 b) { code.push_back(b); }
+			void bytes(std::initializer_list<quint8> b) { code.insert(code.end(), b); }
+			void imm32(quint32 v) { for (int i = 0; i < 4; ++i) byte(v >> (8 * i)); }
+			void imm64(quint64 v) { for (int i = 0; i < 8; ++i) byte(v >> (8 * i)); }
+			void rex(bool w, int r, int b)
+			{
+				quint8 v = 0x40 | (w ? 8 : 0) | (r >= 8 ? 4 : 0) | (b >= 8 ? 1 : 0);
+				if (v != 0x40) byte(v);
+			}
+
+			/* op xmm, [base + disp32] with a mandatory prefix */
+			void mem(quint8 prefix, quint8 op, int xmm, int base, qint32 disp)
+			{
+				byte(prefix);
+				rex(false, xmm, base);
+				bytes({ 0x0F, op });
+				byte(0x80 | ((xmm & 7) << 3) | (base & 7));
+				if ((base & 7) == 4) byte(0x24);
+				imm32(disp);
+			}
+			/* op xmm, xmm */
+			void reg(quint8 prefix, quint8 op, int dst, int src)
+			{
+				byte(prefix);
+				rex(false, dst, src);
+				bytes({ 0x0F, op, quint8(0xC0 | ((dst & 7) << 3) | (src & 7)) });
+			}
+
+			void loadpd(int xmm, int base, qint32 disp) { mem(0x66, 0x10, xmm, base, disp); }
+			void storepd(int xmm, int base, qint32 disp) { mem(0x66, 0x11, xmm, base, disp); }
+			void movapd(int dst, int src) { if (dst != src) reg(0x66, 0x28, dst, src); }
+			void addpd(int dst, int src) { reg(0x66, 0x58, dst, src); }
+			void mulpd(int dst, int src) { reg(0x66, 0x59, dst, src); }
+			void subpd(int dst, int src) { reg(0x66, 0x5C, dst, src); }
+			void mulsd(int dst, int src) { reg(0xF2, 0x59, dst, src); }
+			void divpd(int dst, int src) { reg(0x66, 0x5E, dst, src); }
+			void subsd(int dst, int src) { reg(0xF2, 0x5C, dst, src); }
+			void minpd(int dst, int src) { reg(0x66, 0x5D, dst, src); }
+			void maxpd(int dst, int src) { reg(0x66, 0x5F, dst, src); }
+			void minsd(int dst, int src) { reg(0xF2, 0x5D, dst, src); }
+			void maxsd(int dst, int src) { reg(0xF2, 0x5F, dst, src); }
+			void xorpd(int dst, int src) { reg(0x66, 0x57, dst, src); }
+			void ucomisd(int a, int b) { reg(0x66, 0x2E, a, b); }
+			void unpcklpd(int dst, int src) { reg(0x66, 0x14, dst, src); }
+			void unpckhpd(int dst, int src) { reg(0x66, 0x15, dst, src); }
+			/* Swaps the two halves */
+			void swappd(int x) { reg(0x66, 0xC6, x, x); byte(1); }
+			/* Both halves of xmm = v, through rax */
+			void broadcast(int xmm, real_t v)
+			{
+				quint64 bits;
+				memcpy(&bits, &v, sizeof(bits));
+				bytes({ 0x48, 0xB8 }); imm64(bits);	// mov rax, imm64
+				byte(0x66); rex(true, xmm, 0); bytes({ 0x0F, 0x6E, quint8(0xC0 | ((xmm & 7) << 3)) });	// movq xmm, rax
+				unpcklpd(xmm, xmm);
+			}
+
+			void call(const void* fn)
+			{
+				bytes({ 0x48, 0xB8 }); imm64(reinterpret_cast<quintptr>(fn));	// mov rax, imm64
+				bytes({ 0xFF, 0xD0 });	// call rax
+			}
+			void leaRdi(qint32 disp) { bytes({ 0x48, 0x8D, 0xBB }); imm32(disp); }
+			void movEsi(quint32 v) { byte(0xBE); imm32(v); }
+			void testEax() { bytes({ 0x85, 0xC0 }); }
+			void jnzError() { bytes({ 0x0F, 0x85 }); toError.push_back(code.size()); imm32(0); }
+			void jmpEnd() { byte(0xE9); toEnd.push_back(code.size()); imm32(0); }
+			void jmpSuccess() { byte(0xE9); toSuccess.push_back(code.size()); imm32(0); }
+			/* Forward jumps, bound to the current position by bind() */
+			size_t jb() { bytes({ 0x0F, 0x82 }); imm32(0); return code.size() - 4; }
+			size_t jae() { bytes({ 0x0F, 0x83 }); imm32(0); return code.size() - 4; }
+			size_t jmp() { byte(0xE9); imm32(0); return code.size() - 4; }
+			void bind(size_t site) { patch(std::vector<size_t>(1, site), code.size()); }
+
+			void patch(const std::vector<size_t>& sites, size_t target)
+			{
+				for (size_t site : sites)
+				{
+					qint32 rel = target - (site + 4);
+					memcpy(&code[site], &rel, 4);
+				}
+			}
+	};
+
+	/* Emits code for the stack slots of a program */
+	class Stack
+	{
+		public:
+			Stack(Assembler& _a): a(_a) {}
+			/* xmm = slot k */
+			void get(int xmm, int k)
+			{
+				if (k < regSlots) a.movapd(xmm, 4 + k);
+				else a.loadpd(xmm, RBX, 16 * k);
+			}
+			/* slot k = xmm */
+			void put(int k, int xmm)
+			{
+				if (k < regSlots) a.movapd(4 + k, xmm);
+				else a.storepd(xmm, RBX, 16 * k);
+			}
+			/* Calls clobber every xmm register */
+			void spill(int depth)
+			{
+				for (int k = 0; k < std::min(depth, regSlots); ++k) a.storepd(4 + k, RBX, 16 * k);
+			}
+			void reload(int depth)
+			{
+				for (int k = 0; k < std::min(depth, regSlots); ++k) a.loadpd(4 + k, RBX, 16 * k);
+			}
+		private:
+			Assembler& a;
+	};
+
+	/* Returns false on instructions it cannot translate */
+	bool generate(const MathVm& vm, Assembler& a)
+	{
+		Stack st(a);
+		/* push rbx; push r12; push r13 keep the stack 16-byte aligned for calls */
+		a.bytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });
+		a.bytes({ 0x48, 0x89, 0xFB });	// mov rbx, rdi
+		a.bytes({ 0x49, 0x89, 0xF4 });	// mov r12, rsi
+		a.bytes({ 0x49, 0x89, 0xD5 });	// mov r13, rdx
+
+		int depth = 0;
+		for (auto& i : vm)
+		{
+			int top = depth - 1, needs, pushes;
+			MathVm::stackEffect(i, &needs, &pushes);
+			switch (i.type)
+			{
+				case 'C':
+					a.broadcast(0, i.val);
+					st.put(depth, 0);
+					break;
+				case 'V':
+					a.loadpd(0, R12, 16 * i.arg);
+					st.put(depth, 0);
+					break;
+				case 'P':
+					a.loadpd(0, R13, 16 * int(i.val));
+					st.put(depth, 0);
+					break;
+				case 'D':
+					st.get(0, top);
+					st.put(depth, 0);
+					break;
+				case 'S':
+					st.get(0, top);
+					st.get(1, top - 1);
+					st.put(top - 1, 0);
+					st.put(top, 1);
+					break;
+				case '+':
+					st.get(0, top - 1);
+					st.get(1, top);
+					a.addpd(0, 1);
+					st.put(top - 1, 0);
+					break;
+				case '-':
+					/* [a.min - b.max, a.max - b.min] */
+					st.get(0, top - 1);
+					st.get(1, top);
+					a.swappd(1);
+					a.subpd(0, 1);
+					st.put(top - 1, 0);
+					break;
+				case 'm':
+					st.get(1, top);
+					a.xorpd(0, 0);
+					a.subpd(0, 1);
+					a.swappd(0);
+					st.put(top, 0);
+					break;
+				case '*': case 'd':
+					/* xmm0 = a.min * b, xmm1 = a.max * b; the result is the min and max of their four halves.
+					 * d divides by intervals without zero the same way */
+					st.get(0, top - 1);
+					st.get(2, top);
+					a.movapd(1, 0);
+					a.unpcklpd(0, 0);
+					a.unpckhpd(1, 1);
+					if (i.type == '*')
+					{
+						a.mulpd(0, 2);
+						a.mulpd(1, 2);
+					}
+					else
+					{
+						a.divpd(0, 2);
+						a.divpd(1, 2);
+					}
+					a.movapd(2, 0);
+					a.minpd(2, 1);
+					a.maxpd(0, 1);
+					a.movapd(3, 2);
+					a.unpckhpd(3, 3);
+					a.minsd(2, 3);
+					a.movapd(3, 0);
+					a.unpckhpd(3, 3);
+					a.maxsd(0, 3);
+					a.unpcklpd(2, 0);
+					st.put(top - 1, 2);
+					break;
+				case 'p':
+					/* Both are non-negative: [a.min * b.min, a.max * b.max] */
+					st.get(0, top - 1);
+					st.get(1, top);
+					a.mulpd(0, 1);
+					st.put(top - 1, 0);
+					break;
+				case 'Q':
+					/* [max(0, min, -max)^2, max(min^2, max^2)] */
+					st.get(0, top);
+					a.movapd(1, 0);
+					a.mulpd(1, 1);
+					a.movapd(2, 1);
+					a.unpckhpd(2, 2);
+					a.maxsd(2, 1);
+					a.xorpd(3, 3);
+					a.subpd(3, 0);
+					a.unpckhpd(3, 3);
+					a.xorpd(1, 1);
+					a.maxsd(1, 0);
+					a.maxsd(1, 3);
+					a.mulsd(1, 1);
+					a.unpcklpd(1, 2);
+					st.put(top, 1);
+					break;
+				case '|':
+				{
+					/* The branches of RangeReal::abs(). Comparisons are ordered so that NaNs fail them like in C++ */
+					st.get(0, top);
+					a.movapd(1, 0);
+					a.unpckhpd(1, 1);
+					a.broadcast(2, EPS);
+					a.ucomisd(2, 0);
+					size_t notZero1 = a.jb();	// min > EPS
+					a.broadcast(3, -EPS);
+					a.ucomisd(1, 3);
+					size_t notZero2 = a.jb();	// max < -EPS
+					/* [0, max(-min, max)] */
+					a.xorpd(2, 2);
+					a.subsd(2, 0);
+					a.maxsd(2, 1);
+					a.xorpd(3, 3);
+					a.unpcklpd(3, 2);
+					st.put(top, 3);
+					size_t done1 = a.jmp();
+					a.bind(notZero1);
+					a.bind(notZero2);
+					a.xorpd(2, 2);
+					a.ucomisd(1, 2);
+					size_t done2 = a.jae();	// max >= 0, unchanged
+					/* [-max, -min] */
+					a.subpd(2, 0);
+					a.swappd(2);
+					st.put(top, 2);
+					a.bind(done1);
+					a.bind(done2);
+					break;
+				}
+				case 'Z':
+				{
+					/* containsZero(): min <= 0 && max >= 0 ends the program with this value */
+					st.get(0, top);
+					a.movapd(1, 0);
+					a.unpckhpd(1, 1);
+					a.xorpd(2, 2);
+					a.ucomisd(2, 0);
+					size_t notZero1 = a.jb();	// min > 0
+					a.ucomisd(1, 2);
+					size_t notZero2 = a.jb();	// max < 0
+					a.storepd(0, RBX, 0);
+					a.jmpSuccess();
+					a.bind(notZero1);
+					a.bind(notZero2);
+					break;
+				}
+				case '/': case '^':
+					st.spill(depth);
+					a.leaRdi(16 * (depth - needs));
+					a.movEsi(i.type);
+					a.call(reinterpret_cast<const void*>(&jitCall));
+					a.testEax();
+					a.jnzError();
+					st.reload(depth + pushes);
+					break;
+				default:
+					return false;
+			}
+			depth += pushes;
+		}
+
+		st.get(0, 0);
+		a.storepd(0, RBX, 0);
+		size_t success = a.code.size();
+		a.bytes({ 0x31, 0xC0 });	// xor eax, eax
+		size_t end = a.code.size();
+		a.bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });	// pop r13; pop r12; pop rbx; ret
+		size_t error = a.code.size();
+		a.bytes({ 0xB8, 1, 0, 0, 0 });	// mov eax, 1
+		a.jmpEnd();
+		a.patch(a.toEnd, end);
+		a.patch(a.toSuccess, success);
+		a.patch(a.toError, error);
+		return true;
+	}
+}
+
+void MathVm::compile()
+{
+	jit.reset();
+	if (qEnvironmentVariableIsSet("GDRAWER_NO_JIT"))
+	{
+		return;
+	}
+	Assembler a;
+	try
+	{
+		stackDepth();
+		if (!generate(*this, a))
+		{
+			return;
+		}
+	}
+	catch (Exception)
+	{
+		return;
+	}
+
+	std::shared_ptr<JitCode> code(new JitCode);
+	code->size = a.code.size();
+	code->mem = mmap(NULL, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code->mem == MAP_FAILED)
+	{
+		code->mem = NULL;
+		return;
+	}
+	memcpy(code->mem, a.code.data(), code->size);
+	if (mprotect(code->mem, code->size, PROT_READ | PROT_EXEC))
+	{
+		return;
+	}
+	code->fn = reinterpret_cast<int (*)(Real*, const Real*, const Real*)>(code->mem);
+	jit = code;
+}
+
+#else
+
+void MathVm::compile()
+{
+	jit.reset();
+}
+
+#endif
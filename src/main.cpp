@@ -1,8 +1,188 @@
 #include "gdrawer.hpp"
 #include <QApplication>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <cstring>
+#include <cstdlib>
+
+/* gdrawer --bench formula.txt [width height rounds]
+ * Compares renders on a fresh engine, as every render used to do, with renders on the shared one
+ * and with the renders which trace the curve through monotone cells */
+static int bench(const QStringList& args)
+{
+	QTextStream out(stdout);
+	if (args.size() < 3)
+	{
+		out << "Usage: gdrawer --bench formula.txt [width height rounds]\n";
+		return 1;
+	}
+	try
+	{
+		QStringList parts;
+		std::unique_ptr<Vm> vm(MathVm::get(readFormula(args[2], &parts)));
+		QRectF rect(QPointF(-10, -10), QPointF(10, 10));
+		if (parts.size() == 4)
+		{
+			rect = QRectF(QPointF(parts[0].toDouble(), parts[1].toDouble()), QPointF(parts[2].toDouble(), parts[3].toDouble()));
+		}
+		static_cast<MathVm*>(&*vm)->calibrate(rect);
+		QSize size(args.value(3, "256").toInt(), args.value(4, "256").toInt());
+		int rounds = std::max(1, args.value(5, "100").toInt());
+
+		qint64 startup = 0, teardown = 0, fresh = 0, shared = 0, certified = 0;
+		QElapsedTimer timer;
+		for (int i = 0; i < rounds; ++i)
+		{
+			timer.start();
+			RenderEngine engine;
+			drawFormula(&*vm, rect, size, &engine);
+			teardown += engine.shutdown();
+			fresh += timer.nsecsElapsed();
+			startup += engine.startupTime();
+		}
+		RenderEngine::instance();
+		for (int i = 0; i < rounds; ++i)
+		{
+			timer.start();
+			drawFormula(&*vm, rect, size);
+			shared += timer.nsecsElapsed();
+		}
+		for (int i = 0; i < rounds; ++i)
+		{
+			timer.start();
+			drawCertified(static_cast<MathVm*>(&*vm), rect, size);
+			certified += timer.nsecsElapsed();
+		}
+		out << "engine startup:  " << startup / rounds / 1000 << " us\n"
+		    << "engine teardown: " << teardown / rounds / 1000 << " us\n"
+		    << "fresh engine:    " << fresh / rounds / 1000 << " us per render\n"
+		    << "shared engine:   " << shared / rounds / 1000 << " us per render\n"
+		    << "certified:       " << certified / rounds / 1000 << " us per render\n";
+	}
+	catch (Exception e)
+	{
+		out << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+/* gdrawer --profile formula.txt [width height]
+ * Prints the lines and subexpressions of the formula which take most of the time */
+static int profile(const QStringList& args)
+{
+	QTextStream out(stdout);
+	if (args.size() < 3)
+	{
+		out << "Usage: gdrawer --profile formula.txt [width height]\n";
+		return 1;
+	}
+	try
+	{
+		QStringList parts;
+		std::vector<int> lines;
+		QString source = readFormula(args[2], &parts, &lines);
+		std::unique_ptr<Vm> vm(MathVm::get(source));
+		QRectF rect(QPointF(-10, -10), QPointF(10, 10));
+		if (parts.size() == 4)
+		{
+			rect = QRectF(QPointF(parts[0].toDouble(), parts[1].toDouble()), QPointF(parts[2].toDouble(), parts[3].toDouble()));
+		}
+		MathVm *m = static_cast<MathVm*>(&*vm);
+		m->calibrate(rect);
+		QSize size(args.value(3, "512").toInt(), args.value(4, "512").toInt());
+		out << profileReport(m, profileFormula(m, rect, size), source, lines);
+	}
+	catch (Exception e)
+	{
+		out << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+/* gdrawer --compile formula.txt...
+ * Writes formula.txt.gdvm next to every formula, so a batch run can load them without parsing */
+static int compile(const QStringList& args)
+{
+	QTextStream out(stdout);
+	int failed = 0;
+	for (int i = 2; i < args.size(); ++i)
+	{
+		try
+		{
+			QString source = readFormula(args[i]);
+			std::unique_ptr<Vm> vm(MathVm::get(source));
+			static_cast<MathVm*>(&*vm)->save(args[i] + ".gdvm", source);
+		}
+		catch (Exception e)
+		{
+			out << args[i] << ": " << e.what() << "\n";
+			++failed;
+		}
+	}
+	return failed ? 1 : 0;
+}
 
 int main(int ac, char** av)
 {
+	if (ac > 1 && !strcmp(av[1], "--bench"))
+	{
+		QCoreApplication app(ac, av);
+		return bench(app.arguments());
+	}
+	if (ac == 4 && !strcmp(av[1], "--isolated-worker"))
+	{
+		QCoreApplication app(ac, av);
+		return runIsolatedWorker(app.arguments()[2], app.arguments()[3]);
+	}
+	if (ac >= 3 && !strcmp(av[1], "--serve"))
+	{
+		/* gdrawer --serve name [cache size], name is a local server name or host:port, :port listens on localhost */
+		QCoreApplication app(ac, av);
+		RenderServer server(ac > 3 ? atoi(av[3]) : 32);
+		if (!server.listen(app.arguments()[2]))
+		{
+			return 1;
+		}
+		return app.exec();
+	}
+	if (ac == 4 && !strcmp(av[1], "--request"))
+	{
+		/* gdrawer --request name json */
+		QCoreApplication app(ac, av);
+		return runRenderClient(app.arguments()[2], app.arguments()[3]);
+	}
+	if (ac > 1 && !strcmp(av[1], "--distribute"))
+	{
+		QCoreApplication app(ac, av);
+		return runCoordinator(app.arguments());
+	}
+	if (ac > 1 && !strcmp(av[1], "--runs"))
+	{
+		QCoreApplication app(ac, av);
+		return runSaveRuns(app.arguments());
+	}
+	if (ac > 1 && !strcmp(av[1], "--diff"))
+	{
+		QCoreApplication app(ac, av);
+		return runDiff(app.arguments());
+	}
+	if (ac > 1 && !strcmp(av[1], "--profile"))
+	{
+		QCoreApplication app(ac, av);
+		return profile(app.arguments());
+	}
+	if (ac > 1 && !strcmp(av[1], "--selftest"))
+	{
+		QCoreApplication app(ac, av);
+		return runSelfTest();
+	}
+	if (ac > 1 && !strcmp(av[1], "--compile"))
+	{
+		QCoreApplication app(ac, av);
+		return compile(app.arguments());
+	}
 	QApplication app(ac, av);
 	MainWindow w;
 	w.show();
@@ -18,10 +18,30 @@ using namespace spirit;
 using namespace ascii;
 using namespace phoenix;
 
+/* Remembers where a subexpression was found. Nodes passed up unchanged get the outermost span,
+ * so that it includes the parentheses around them */
+template<class Iterator>
+struct SetSpan
+{
+	typedef void result_type;
+	template<class...> struct result { typedef void type; };
+
+	Iterator start;
+	SetSpan(Iterator _start): start(_start) {}
+	void operator()(expr_t* e, Iterator begin, Iterator end) const
+	{
+		if (e)
+		{
+			e->begin = begin - start;
+			e->end = end - start;
+		}
+	}
+};
+
 template<class Iterator>
 struct ExprGrammar : qi::grammar<Iterator, expr_t*(), ascii::space_type>
 {
-	ExprGrammar(): ExprGrammar::base_type(expr, "Expression")
+	ExprGrammar(Iterator start): ExprGrammar::base_type(expr, "Expression"), setSpan(SetSpan<Iterator>(start))
 	{
 		primitive.name("Primitive");
 		factor.name("Factor");
@@ -50,6 +70,12 @@ struct ExprGrammar : qi::grammar<Iterator, expr_t*(), ascii::space_type>
 		expr
 			= term[_val = _1] >> *(char_("+-") >> term)[_val = new_<binop_t>(_1, _val, _2)];
 
+		qi::on_success(primitive, setSpan(_val, _1, _3));
+		qi::on_success(primitive2, setSpan(_val, _1, _3));
+		qi::on_success(factor, setSpan(_val, _1, _3));
+		qi::on_success(term, setSpan(_val, _1, _3));
+		qi::on_success(expr, setSpan(_val, _1, _3));
+
 		qi::on_error<qi::fail>
 		(
 			expr,
@@ -66,14 +92,15 @@ struct ExprGrammar : qi::grammar<Iterator, expr_t*(), ascii::space_type>
 	
 	qi::rule<Iterator, expr_t*(), ascii::space_type> primitive, primitive2, factor, term, expr;
 	qi::real_parser<real_t> real;
+	phoenix::function<SetSpan<Iterator>> setSpan;
 };
 
 Vm *MathVm::get(const QString& expr)
 {
 	expr_t* tree = NULL;
 	std::string s = expr.toStdString();
-	ExprGrammar<std::string::const_iterator> g;
 	std::string::const_iterator begin = s.begin(), end = s.end();
+	ExprGrammar<std::string::const_iterator> g(begin);
 	bool r = phrase_parse(begin, end, g, space, tree);
 	if (!r || begin != end || !tree)
 	{
@@ -82,9 +109,27 @@ Vm *MathVm::get(const QString& expr)
 		throw Exception("Syntax error");
 	}
 
-	MathVm *ret = new MathVm;
-	tree->addInstr(ret);
-	ret->requiredStackSize = tree->getDepth();
+	std::unique_ptr<MathVm> ret(new MathVm);
+	std::vector<const expr_t*> chain;
+	splitProduct(tree, chain);
+	if (chain.size() > 1)
+	{
+		for (auto factor : chain)
+		{
+			MathVm code;
+			factor->addInstr(&code);
+			ret->factors.push_back(code);
+		}
+		ret->link();
+	}
+	else
+	{
+		tree->addInstr(&*ret);
+		/* tree->getDepth() does not account for the copies made by the a ^ n expansion */
+		ret->requiredStackSize = ret->stackDepth();
+		ret->compile();
+		ret->findPolynomials();
+	}
 	delete tree;
-	return ret;
+	return ret.release();
 }
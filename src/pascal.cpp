@@ -51,7 +51,7 @@ Vm *createVm(const QString tmp1Name, const char *fn) {
 	return ret;
 }
 
-Vm* getPascalVm(const QString& prog)
+Vm* getPascalVm(const QString& prog, bool isolated)
 {
 	QTemporaryFile tmp(QDir::tempPath() + "/solution.XXXXXX.pas");
 	if (!tmp.open())
@@ -100,6 +100,8 @@ Vm* getPascalVm(const QString& prog)
 		throw Exception(QString("fpc: %1").arg(QString::CONVERTOR(fpc.readAllStandardError())));
 	}
 
+	if (isolated)
+		return new IsolatedVm(tmp1Name, "pascal_run");
 	return createVm(tmp1Name, "pascal_run");
 }
 
@@ -117,7 +119,7 @@ PascalVm::~PascalVm()
 	}
 }
 
-Vm* getCppVm(const QString& prog) {
+Vm* getCppVm(const QString& prog, bool isolated) {
 	QTemporaryFile tmp(QDir::tempPath() + "/solution.XXXXXX.cpp");
 	if (!tmp.open())
 		throw Exception("Cannot create temp file");
@@ -146,5 +148,7 @@ Vm* getCppVm(const QString& prog) {
 		throw Exception(QString("gcc: %1").arg(QString::CONVERTOR(gcc.readAllStandardError())));
 	}
 
+	if (isolated)
+		return new IsolatedVm(tmp1Name, "cpp_run");
 	return createVm(tmp1Name, "cpp_run");
 }
@@ -0,0 +1,151 @@
+#include "gdrawer.hpp"
+#include <QTextStream>
+#include <algorithm>
+
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+#define PROFILE_UNIT "cycles"
+#else
+#define PROFILE_UNIT "ns"
+#endif
+
+Profile profileFormula(const MathVm* vm, const QRectF& rect, const QSize& viewport)
+{
+	RenderEngine *engine = RenderEngine::instance();
+	int height = viewport.height(), width = viewport.width(), bands = std::min(4 * engine->threadCount(), height);
+	real_t dx = rect.width() / width, dy = rect.height() / height;
+	/* One profile per band, so that workers do not share counters */
+	std::vector<Profile> profiles(bands);
+	std::vector<RenderEngine::Job> jobs;
+	for (int i = 0; i < bands; ++i)
+	{
+		int top = height * i / bands, bottom = height * (i + 1) / bands;
+		Profile *profile = &profiles[i];
+		jobs.push_back([=](RenderSlot& slot)
+		{
+			Ctx *ctx = slot.getCtx(vm);
+			for (int py = top; py != bottom; ++py)
+			{
+				real_t y = rect.bottom() - py * dy;
+				ctx->setVar('y', Real(y, y + dy));
+				for (int px = 0; px != width; ++px)
+				{
+					real_t x = rect.left() + px * dx;
+					ctx->setVar('x', Real(x, x + dx));
+					/* Points which throw are profiled up to the failing instruction */
+					try
+					{
+						vm->profile(ctx, *profile);
+					}
+					catch (Exception)
+					{
+					}
+				}
+			}
+		});
+	}
+	engine->run(jobs);
+
+	Profile ret;
+	for (auto& profile : profiles)
+	{
+		ret.merge(profile);
+	}
+	return ret;
+}
+
+namespace
+{
+	struct Span
+	{
+		int begin, end;
+		double self, total;
+		quint64 count;
+	};
+
+	QString shorten(QString text, int length = 60)
+	{
+		text = text.simplified();
+		return text.size() > length ? text.left(length - 3) + "..." : text;
+	}
+}
+
+QString profileReport(const MathVm* vm, const Profile& profile, const QString& source, const std::vector<int>& lines)
+{
+	QString ret;
+	QTextStream out(&ret);
+	if (!profile.sampledRuns || profile.counts.size() != vm->size())
+	{
+		out << "No evaluations were profiled\n";
+		return ret;
+	}
+
+	/* Cycles are scaled from the sampled runs to all of them */
+	QByteArray text = source.toUtf8();
+	double scale = double(profile.runs) / profile.sampledRuns, total = 0;
+	std::vector<double> cost(vm->size());
+	for (size_t k = 0; k < vm->size(); ++k)
+	{
+		cost[k] = profile.cycles[k] * scale;
+		total += cost[k];
+	}
+	total = std::max(total, 1.0);
+	out << QString("%1 evaluations, %2 " PROFILE_UNIT " per evaluation in the interpreter\n\n")
+		.arg(profile.runs).arg(total / profile.runs, 0, 'f', 1);
+
+	/* Instructions without a span are the glue of factor chains, line 0 */
+	std::map<int, double> lineCost;
+	std::map<std::pair<int, int>, Span> spans;
+	for (size_t k = 0; k < vm->size(); ++k)
+	{
+		const Instr& i = (*vm)[k];
+		bool known = i.begin >= 0 && i.end <= text.size();
+		lineCost[known && size_t(i.begin) < lines.size() ? lines[i.begin] : 0] += cost[k];
+		if (known)
+		{
+			Span& span = spans[std::make_pair(i.begin, i.end)];
+			span.begin = i.begin;
+			span.end = i.end;
+			span.self += cost[k];
+			span.count = std::max(span.count, profile.counts[k]);
+		}
+	}
+
+	out << "Lines:\n";
+	for (auto& line : lineCost)
+	{
+		QByteArray lineText;
+		for (size_t b = 0; b < lines.size() && int(b) < text.size(); ++b)
+		{
+			if (lines[b] == line.first) lineText.append(text[int(b)]);
+		}
+		out << QString("%1 %2% ").arg(line.first ? QString::number(line.first) : QString("-"), 5)
+			.arg(100 * line.second / total, 6, 'f', 1)
+			<< (line.first ? shorten(QString::fromUtf8(lineText)) : QString("(factor chain)")) << "\n";
+	}
+
+	/* Subexpressions with everything inside them, the hottest first */
+	std::vector<Span> sorted;
+	for (auto& span : spans)
+	{
+		Span s = span.second;
+		for (auto& inner : spans)
+		{
+			if (s.begin <= inner.second.begin && inner.second.end <= s.end)
+			{
+				s.total += inner.second.self;
+			}
+		}
+		sorted.push_back(s);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const Span& a, const Span& b) { return a.total > b.total; });
+	out << "\nSubexpressions:  total   self  evaluations\n";
+	for (size_t i = 0; i < sorted.size() && i < 20; ++i)
+	{
+		const Span& s = sorted[i];
+		int line = size_t(s.begin) < lines.size() ? lines[s.begin] : 0;
+		out << QString("%1 %2% %3% %4 ").arg(line ? QString::number(line) : QString("-"), 5)
+			.arg(100 * s.total / total, 6, 'f', 1).arg(100 * s.self / total, 6, 'f', 1).arg(s.count, 12)
+			<< shorten(QString::fromUtf8(text.mid(s.begin, s.end - s.begin))) << "\n";
+	}
+	return ret;
+}
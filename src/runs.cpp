@@ -0,0 +1,421 @@
+#include "gdrawer.hpp"
+#include <QFile>
+#include <QTextStream>
+#include <QtEndian>
+#include <climits>
+
+/* On disk a render is a header and the rows one after another. A row is the number of its runs
+ * and the gap before every run and its length, all of them as LEB128 varints, so that a row
+ * without curve takes a byte. All numbers in the header are little-endian */
+
+namespace
+{
+	const char magic[4] = { 'G', 'D', 'R', 'N' };
+	const quint32 version = 1;
+
+	struct Header
+	{
+		char magic[4];
+		quint32 version, width, height;
+	};
+
+	static_assert(sizeof(Header) == 16, "Unexpected padding in runs layout");
+
+	void putVarint(QByteArray& out, quint32 v)
+	{
+		while (v >= 0x80)
+		{
+			out.append(char(v | 0x80));
+			v >>= 7;
+		}
+		out.append(char(v));
+	}
+
+	quint32 getVarint(const uchar*& p, const uchar* end)
+	{
+		quint32 ret = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			if (p == end)
+			{
+				throw Exception("Runs are truncated");
+			}
+			uchar b = *p++;
+			ret |= quint32(b & 0x7F) << shift;
+			if (!(b & 0x80))
+			{
+				return ret;
+			}
+		}
+		throw Exception("Runs are corrupted");
+	}
+
+	/* Merges two rows, keeping the pixels for which op(in a, in b) holds. op(false, false) must be false.
+	 * Runs of a row never touch, so neither do the merged ones */
+	template<class Op>
+	void combineRow(const CurveRuns::Run* a, const CurveRuns::Run* aEnd, const CurveRuns::Run* b, const CurveRuns::Run* bEnd,
+		Op op, std::vector<CurveRuns::Run>& out)
+	{
+		bool inA = false, inB = false, in = false;
+		qint32 start = 0;
+		while (a != aEnd || b != bEnd)
+		{
+			qint32 nextA = a != aEnd ? (inA ? a->end : a->begin) : INT_MAX;
+			qint32 nextB = b != bEnd ? (inB ? b->end : b->begin) : INT_MAX;
+			qint32 x = std::min(nextA, nextB);
+			if (nextA == x)
+			{
+				if (inA) ++a;
+				inA = !inA;
+			}
+			if (nextB == x)
+			{
+				if (inB) ++b;
+				inB = !inB;
+			}
+			bool value = op(inA, inB);
+			if (value != in)
+			{
+				if (value)
+				{
+					start = x;
+				}
+				else
+				{
+					out.push_back(CurveRuns::Run{ start, x });
+				}
+				in = value;
+			}
+		}
+	}
+
+	template<class Op>
+	CurveRuns combine(const CurveRuns& a, const CurveRuns& b, Op op)
+	{
+		if (a.width != b.width || a.height != b.height)
+		{
+			throw Exception("Renders have different sizes");
+		}
+		CurveRuns ret(a.width);
+		for (int y = 0; y < a.height; ++y)
+		{
+			combineRow(a.runs.data() + a.rows[y], a.runs.data() + a.rows[y + 1],
+				b.runs.data() + b.rows[y], b.runs.data() + b.rows[y + 1], op, ret.runs);
+			ret.rows.push_back(ret.runs.size());
+		}
+		ret.height = a.height;
+		return ret;
+	}
+}
+
+CurveRuns::CurveRuns(int _width): width(_width), height(0), rows(1, 0)
+{
+}
+
+CurveRuns CurveRuns::fromImage(const QImage& img)
+{
+	CurveRuns ret(img.width());
+	for (int y = 0; y < img.height(); ++y)
+	{
+		ret.addRow(img.constScanLine(y));
+	}
+	return ret;
+}
+
+QImage CurveRuns::toImage() const
+{
+	QImage ret(width, height, QImage::Format_Indexed8);
+	ret.setColor(0, qRgb(255, 255, 255));
+	ret.setColor(1, qRgb(0, 0, 0));
+	ret.setColor(2, qRgb(255, 255, 0));
+	ret.fill(0);
+	for (int y = 0; y < height; ++y)
+	{
+		uchar *line = ret.scanLine(y);
+		for (quint32 i = rows[y]; i < rows[y + 1]; ++i)
+		{
+			memset(line + runs[i].begin, 1, runs[i].end - runs[i].begin);
+		}
+	}
+	return ret;
+}
+
+void CurveRuns::addRow(const uchar* line)
+{
+	for (int x = 0; x < width; )
+	{
+		if (line[x] != 1)
+		{
+			++x;
+			continue;
+		}
+		int begin = x;
+		while (x < width && line[x] == 1) ++x;
+		runs.push_back(Run{ begin, x });
+	}
+	rows.push_back(runs.size());
+	++height;
+}
+
+void CurveRuns::append(const CurveRuns& other)
+{
+	if (other.width != width)
+	{
+		throw Exception("Renders have different sizes");
+	}
+	quint32 offset = runs.size();
+	runs.insert(runs.end(), other.runs.begin(), other.runs.end());
+	for (int y = 1; y <= other.height; ++y)
+	{
+		rows.push_back(offset + other.rows[y]);
+	}
+	height += other.height;
+}
+
+qint64 CurveRuns::count() const
+{
+	qint64 ret = 0;
+	for (auto& run : runs)
+	{
+		ret += run.end - run.begin;
+	}
+	return ret;
+}
+
+CurveRuns CurveRuns::unite(const CurveRuns& other) const
+{
+	return combine(*this, other, [](bool a, bool b) { return a || b; });
+}
+
+CurveRuns CurveRuns::subtract(const CurveRuns& other) const
+{
+	return combine(*this, other, [](bool a, bool b) { return a && !b; });
+}
+
+CurveRuns CurveRuns::symmetricDifference(const CurveRuns& other) const
+{
+	return combine(*this, other, [](bool a, bool b) { return a != b; });
+}
+
+CurveRuns CurveRuns::dilate(int radius) const
+{
+	if (radius <= 0)
+	{
+		return *this;
+	}
+	/* Widen the runs of every row, then unite every row with its neighbours */
+	CurveRuns wide(width);
+	for (int y = 0; y < height; ++y)
+	{
+		for (quint32 i = rows[y]; i < rows[y + 1]; ++i)
+		{
+			Run run = { std::max(0, runs[i].begin - radius), std::min(width, runs[i].end + radius) };
+			if (wide.runs.size() > wide.rows.back() && wide.runs.back().end >= run.begin)
+			{
+				wide.runs.back().end = run.end;
+			}
+			else
+			{
+				wide.runs.push_back(run);
+			}
+		}
+		wide.rows.push_back(wide.runs.size());
+	}
+	wide.height = height;
+
+	CurveRuns ret(width);
+	std::vector<Run> row, merged;
+	for (int y = 0; y < height; ++y)
+	{
+		row.clear();
+		for (int n = std::max(0, y - radius); n <= std::min(height - 1, y + radius); ++n)
+		{
+			merged.clear();
+			combineRow(row.data(), row.data() + row.size(), wide.runs.data() + wide.rows[n], wide.runs.data() + wide.rows[n + 1],
+				[](bool a, bool b) { return a || b; }, merged);
+			row.swap(merged);
+		}
+		ret.runs.insert(ret.runs.end(), row.begin(), row.end());
+		ret.rows.push_back(ret.runs.size());
+	}
+	ret.height = height;
+	return ret;
+}
+
+void CurveRuns::save(const QString& filename) const
+{
+	Header header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = qToLittleEndian(version);
+	header.width = qToLittleEndian(quint32(width));
+	header.height = qToLittleEndian(quint32(height));
+
+	QByteArray data(reinterpret_cast<const char*>(&header), sizeof(header));
+	for (int y = 0; y < height; ++y)
+	{
+		putVarint(data, rows[y + 1] - rows[y]);
+		qint32 last = 0;
+		for (quint32 i = rows[y]; i < rows[y + 1]; ++i)
+		{
+			putVarint(data, runs[i].begin - last);
+			putVarint(data, runs[i].end - runs[i].begin);
+			last = runs[i].end;
+		}
+	}
+
+	QFile f(filename);
+	if (!f.open(QIODevice::WriteOnly) || f.write(data) != data.size())
+	{
+		throw Exception(QString("Cannot write %1").arg(filename));
+	}
+}
+
+CurveRuns CurveRuns::load(const QString& filename)
+{
+	QFile f(filename);
+	if (!f.open(QIODevice::ReadOnly))
+	{
+		throw Exception(QString("Cannot open %1").arg(filename));
+	}
+	QByteArray data = f.readAll();
+	if (data.size() < int(sizeof(Header)) || memcmp(data.constData(), magic, sizeof(magic)))
+	{
+		throw Exception(QString("%1 is not a render").arg(filename));
+	}
+	Header header;
+	memcpy(&header, data.constData(), sizeof(header));
+	if (qFromLittleEndian(header.version) != version)
+	{
+		throw Exception(QString("%1 was written by another version of gdrawer").arg(filename));
+	}
+
+	CurveRuns ret(qFromLittleEndian(header.width));
+	quint32 height = qFromLittleEndian(header.height);
+	const uchar *p = reinterpret_cast<const uchar*>(data.constData()) + sizeof(header), *end = p + data.size() - sizeof(header);
+	try
+	{
+		for (quint32 y = 0; y < height; ++y)
+		{
+			quint32 count = getVarint(p, end);
+			qint64 last = 0;
+			for (quint32 i = 0; i < count; ++i)
+			{
+				qint64 begin = last + getVarint(p, end), length = getVarint(p, end);
+				/* Runs are sorted, not empty and do not touch */
+				if (!length || (i && begin == last) || begin + length > ret.width)
+				{
+					throw Exception("Runs are corrupted");
+				}
+				ret.runs.push_back(Run{ qint32(begin), qint32(begin + length) });
+				last = begin + length;
+			}
+			ret.rows.push_back(ret.runs.size());
+			++ret.height;
+		}
+		if (p != end)
+		{
+			throw Exception("Runs are corrupted");
+		}
+	}
+	catch (Exception e)
+	{
+		e.append(filename);
+		throw e;
+	}
+	return ret;
+}
+
+namespace
+{
+	/* Renders are .runs files or formulas, which are drawn in the rect of the first one which has it
+	 * and in the size of the first .runs file, if there is one */
+	std::vector<CurveRuns> getRuns(const QStringList& names, QSize size)
+	{
+		QRectF rect(QPointF(-10, -10), QPointF(10, 10));
+		QStringList sources;
+		for (int i = names.size() - 1; i >= 0; --i)
+		{
+			QStringList parts;
+			sources.prepend(names[i].endsWith(".runs") ? QString() : readFormula(names[i], &parts));
+			if (parts.size() == 4)
+			{
+				rect = QRectF(QPointF(parts[0].toDouble(), parts[1].toDouble()), QPointF(parts[2].toDouble(), parts[3].toDouble()));
+			}
+		}
+
+		std::vector<CurveRuns> ret(names.size());
+		for (int i = names.size() - 1; i >= 0; --i)
+		{
+			if (sources[i].isNull())
+			{
+				ret[i] = CurveRuns::load(names[i]);
+				size = QSize(ret[i].width, ret[i].height);
+			}
+		}
+		for (int i = 0; i < names.size(); ++i)
+		{
+			if (!sources[i].isNull())
+			{
+				std::unique_ptr<Vm> vm(MathVm::get(sources[i]));
+				static_cast<MathVm*>(&*vm)->calibrate(rect);
+				ret[i] = drawRuns(&*vm, rect, size);
+			}
+		}
+		return ret;
+	}
+}
+
+/* gdrawer --runs formula.txt output.runs [width height] */
+int runSaveRuns(const QStringList& args)
+{
+	QTextStream out(stdout);
+	if (args.size() < 4)
+	{
+		out << "Usage: gdrawer --runs formula.txt output.runs [width height]\n";
+		return 1;
+	}
+	try
+	{
+		QSize size(args.value(4, "512").toInt(), args.value(5, "512").toInt());
+		CurveRuns runs = getRuns(QStringList() << args[2], size)[0];
+		runs.save(args[3]);
+		out << runs.count() << " pixels in " << runs.runs.size() << " runs\n";
+	}
+	catch (Exception e)
+	{
+		out << "Error: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+/* gdrawer --diff a b [tolerance] [width height]
+ * Counts the pixels of each render farther than tolerance pixels from the other one */
+int runDiff(const QStringList& args)
+{
+	QTextStream out(stdout);
+	if (args.size() < 4)
+	{
+		out << "Usage: gdrawer --diff a b [tolerance] [width height]\n"
+		    << "a and b are .runs files or formulas\n";
+		return 1;
+	}
+	try
+	{
+		QSize size(args.value(5, "512").toInt(), args.value(6, "512").toInt());
+		std::vector<CurveRuns> renders = getRuns(args.mid(2, 2), size);
+		const CurveRuns& a = renders[0], &b = renders[1];
+		int tolerance = args.value(4, "0").toInt();
+		qint64 missing = a.subtract(b.dilate(tolerance)).count(), extra = b.subtract(a.dilate(tolerance)).count();
+		out << args[2] << ": " << a.count() << " pixels in " << a.runs.size() << " runs\n"
+		    << args[3] << ": " << b.count() << " pixels in " << b.runs.size() << " runs\n"
+		    << "only in " << args[2] << ": " << missing << "\n"
+		    << "only in " << args[3] << ": " << extra << "\n";
+		return missing || extra ? 2 : 0;
+	}
+	catch (Exception e)
+	{
+		out << "Error: " << e.what() << "\n";
+		return 1;
+	}
+}
@@ -0,0 +1,470 @@
+#include "gdrawer.hpp"
+#include <QDebug>
+#include <cfloat>
+
+/* Polynomial subtrees are found by running the code on a stack of polynomials. Over a row of pixels such a
+ * polynomial is one in x whose coefficients are intervals, kept as midpoints and radii. Its value over the pixel
+ * [x, x + dx] is enclosed by the Taylor coefficients at x: p(x + t) = sum T_k(x) t^k with t in [0, dx].
+ * T_k of the midpoints is a polynomial in the pixel number, and so is T_k of the radii at |x| on either side of
+ * zero, so both are advanced from pixel to pixel with additions by forward differences. The differences are
+ * computed again every few pixels and where x changes its sign, a bound of their rounding errors widens the values.
+ * How often depends on the degree of the polynomial only, so a polynomial gets the same values in every program */
+
+namespace
+{
+	/* Higher degrees are left to the interpreter */
+	const int maxDegree = 8;
+	const int maxSegment = 64;
+
+	real_t binomial(int n, int k)
+	{
+		real_t ret = 1;
+		for (int i = 1; i <= k; ++i)
+		{
+			ret = ret * (n - k + i) / i;
+		}
+		return ret;
+	}
+
+	/* Bounds the rounding errors of n steps of forward differences of degree m relative to the largest term:
+	 * Horner's rule and taking the differences round difference s at most 2m + s + 2 times, and every step
+	 * adds the errors of the differences to the values */
+	real_t growth(int n, int m)
+	{
+		real_t ret = 0;
+		for (int s = 0; s <= m; ++s)
+		{
+			ret += binomial(n, s) * std::ldexp(2 * m + s + 3, s);
+		}
+		return ret;
+	}
+
+	Polynomial resized(const Polynomial& p, int degreeX, int degreeY)
+	{
+		Polynomial ret;
+		ret.degreeX = degreeX;
+		ret.degreeY = degreeY;
+		ret.coeffs.assign((degreeX + 1) * (degreeY + 1), 0);
+		for (int i = 0; i <= std::min(degreeX, p.degreeX); ++i)
+		{
+			for (int j = 0; j <= std::min(degreeY, p.degreeY); ++j)
+			{
+				ret.coeffs[i * (degreeY + 1) + j] = p.at(i, j);
+			}
+		}
+		return ret;
+	}
+
+	/* Drops the highest powers while their coefficients are zero */
+	Polynomial trimmed(const Polynomial& p)
+	{
+		int degreeX = 0, degreeY = 0;
+		for (int i = 0; i <= p.degreeX; ++i)
+		{
+			for (int j = 0; j <= p.degreeY; ++j)
+			{
+				if (p.at(i, j) != 0)
+				{
+					degreeX = std::max(degreeX, i);
+					degreeY = std::max(degreeY, j);
+				}
+			}
+		}
+		return resized(p, degreeX, degreeY);
+	}
+
+	Polynomial variable(bool y)
+	{
+		Polynomial ret;
+		ret.degreeX = !y;
+		ret.degreeY = y;
+		ret.coeffs.assign(2, 0);
+		ret.coeffs[1] = 1;
+		return ret;
+	}
+
+	/* a + sign * b */
+	Polynomial add(const Polynomial& a, const Polynomial& b, real_t sign)
+	{
+		Polynomial ret = resized(a, std::max(a.degreeX, b.degreeX), std::max(a.degreeY, b.degreeY));
+		for (int i = 0; i <= b.degreeX; ++i)
+		{
+			for (int j = 0; j <= b.degreeY; ++j)
+			{
+				ret.coeffs[i * (ret.degreeY + 1) + j] += sign * b.at(i, j);
+			}
+		}
+		return trimmed(ret);
+	}
+
+	Polynomial multiply(const Polynomial& a, const Polynomial& b)
+	{
+		Polynomial ret = resized(Polynomial(), a.degreeX + b.degreeX, a.degreeY + b.degreeY);
+		for (int i = 0; i <= a.degreeX; ++i)
+		{
+			for (int j = 0; j <= a.degreeY; ++j)
+			{
+				for (int k = 0; k <= b.degreeX; ++k)
+				{
+					for (int l = 0; l <= b.degreeY; ++l)
+					{
+						ret.coeffs[(i + k) * (ret.degreeY + 1) + j + l] += a.at(i, j) * b.at(k, l);
+					}
+				}
+			}
+		}
+		return trimmed(ret);
+	}
+
+	bool isConstant(const Polynomial& p)
+	{
+		return !p.degreeX && !p.degreeY;
+	}
+
+	/* The polynomial a stack slot holds, unless known is unset. Instructions [begin, end) computed it */
+	struct Entry
+	{
+		Polynomial poly;
+		bool known;
+		size_t begin, end;
+	};
+
+	/* Sum of c[t] x^t for t in [0, n] */
+	inline real_t horner(const real_t* c, int n, real_t x)
+	{
+		real_t ret = c[n];
+		for (int t = n - 1; t >= 0; --t)
+		{
+			ret = ret * x + c[t];
+		}
+		return ret;
+	}
+}
+
+void MathVm::findPolynomials()
+{
+	scanline.reset();
+	/* Native code evaluates polynomials about as fast, and the bounds of the differences give other pixels
+	 * than evaluating them does, so the scanline program only runs on request */
+	if (!qEnvironmentVariableIsSet("GDRAWER_SCANLINE"))
+	{
+		return;
+	}
+
+	/* Depth of the stack before every instruction, and the slots it reads */
+	std::vector<int> depth(1, 0), reads;
+	std::vector<Entry> stack, found;
+	/* A polynomial is complete when code which is not polynomial takes it */
+	auto settle = [&](const Entry& e)
+	{
+		if (e.known) found.push_back(e);
+	};
+	try
+	{
+		for (size_t k = 0; k < size(); ++k)
+		{
+			const Instr& i = (*this)[k];
+			int needs, pushes;
+			stackEffect(i, &needs, &pushes);
+			depth.push_back(depth.back() + pushes);
+			reads.push_back(needs);
+
+			Entry e = { Polynomial(), false, k, k + 1 };
+			switch (i.type)
+			{
+				case 'C':
+					e.poly = Polynomial(i.val);
+					e.known = true;
+					break;
+				case 'V':
+					e.known = i.arg == 'x' - 'a' || i.arg == 'y' - 'a';
+					if (e.known) e.poly = variable(i.arg == 'y' - 'a');
+					break;
+				case 'D':
+					/* The copy is computed by the same code and D */
+					e = stack.back();
+					e.end = k + 1;
+					break;
+				case 'S':
+					std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+					continue;
+				case 'm':
+					e = stack.back();
+					stack.pop_back();
+					if (e.known) e.poly = add(Polynomial(), e.poly, -1);
+					e.end = k + 1;
+					break;
+				case '+': case '-': case '*': case '^':
+				{
+					Entry b = stack.back();
+					stack.pop_back();
+					Entry a = stack.back();
+					stack.pop_back();
+					e.begin = std::min(a.begin, b.begin);
+					if (a.known && b.known)
+					{
+						if (i.type == '*')
+						{
+							e.poly = multiply(a.poly, b.poly);
+						}
+						else if (i.type != '^')
+						{
+							e.poly = add(a.poly, b.poly, i.type == '+' ? 1 : -1);
+						}
+						else if (isConstant(b.poly) && b.poly.coeffs[0] >= 0 && b.poly.coeffs[0] <= maxDegree
+							&& b.poly.coeffs[0] == int(b.poly.coeffs[0]))
+						{
+							e.poly = Polynomial(1);
+							for (int n = 0; n < b.poly.coeffs[0]; ++n)
+							{
+								e.poly = multiply(e.poly, a.poly);
+							}
+						}
+						else
+						{
+							e.poly.degreeX = maxDegree + 1;
+						}
+						e.known = e.poly.degreeX <= maxDegree && e.poly.degreeY <= maxDegree;
+					}
+					if (!e.known)
+					{
+						settle(a);
+						settle(b);
+					}
+					break;
+				}
+				default:
+					for (int n = 0; n < needs; ++n)
+					{
+						settle(stack.back());
+						stack.pop_back();
+					}
+					break;
+			}
+			stack.push_back(e);
+		}
+		settle(stack.back());
+	}
+	catch (Exception)
+	{
+		return;
+	}
+
+	/* Only polynomials whose code takes nothing from the stack below it can be replaced, larger ones first.
+	 * A pixel of a polynomial costs about as much as adding its differences, so cheap code is kept,
+	 * weights are the ones of calibrate() */
+	std::sort(found.begin(), found.end(), [](const Entry& a, const Entry& b) { return a.end - a.begin > b.end - b.begin; });
+	std::vector<const Entry*> chosen;
+	for (auto& e : found)
+	{
+		double cost = 0;
+		for (size_t k = e.begin; k < e.end; ++k)
+		{
+			char type = (*this)[k].type;
+			cost += type == '^' ? 8 : type == '/' ? 4 : type == '*' ? 2 : 1;
+		}
+		int table = (e.poly.degreeX + 1) * (e.poly.degreeX + 2) / 2;
+		bool valid = e.end - e.begin >= 3 && cost > 2 * table && depth[e.end] == depth[e.begin] + 1;
+		for (size_t k = e.begin; k < e.end && valid; ++k)
+		{
+			valid = depth[k] - reads[k] >= depth[e.begin];
+		}
+		for (auto c : chosen)
+		{
+			valid = valid && (e.end <= c->begin || c->end <= e.begin);
+		}
+		if (valid) chosen.push_back(&e);
+	}
+	if (chosen.empty())
+	{
+		return;
+	}
+
+	std::sort(chosen.begin(), chosen.end(), [](const Entry* a, const Entry* b) { return a->begin < b->begin; });
+	std::shared_ptr<MathVm> ret(new MathVm);
+	auto next = chosen.begin();
+	for (size_t k = 0; k < size(); )
+	{
+		if (next == chosen.end() || k != (*next)->begin)
+		{
+			ret->push_back((*this)[k++]);
+			continue;
+		}
+		int begin = -1, end = -1;
+		for (; k < (*next)->end; ++k)
+		{
+			const Instr& i = (*this)[k];
+			if (i.begin >= 0 && (begin < 0 || i.begin < begin)) begin = i.begin;
+			end = std::max(end, i.end);
+		}
+		ret->emplace_back('P', 0, ret->polys.size(), begin, end);
+		ret->polys.push_back((*next)->poly);
+		++next;
+	}
+	ret->requiredStackSize = ret->stackDepth();
+	ret->compile();
+	scanline = ret;
+	qDebug() << "polynomials:" << ret->polys.size() << "instructions:" << size() << "->" << ret->size();
+}
+
+Scanline::Scanline(const MathVm* _program, real_t _left, real_t _dx):
+	program(_program), left(_left), dx(_dx), rows(_program->polys.size()), values(rows.size()), px(0)
+{
+	/* The first pixel from which x is not negative */
+	positive = std::max<int>(0, std::ceil(-left / dx) - 1);
+	while (left + positive * dx < 0) ++positive;
+
+	for (size_t p = 0; p < rows.size(); ++p)
+	{
+		Row& row = rows[p];
+		row.degree = program->polys[p].degreeX;
+		/* The rounding errors of the differences add up to at most growth() times the largest term */
+		row.segment = maxSegment;
+		while (row.segment > 1 && growth(row.segment, row.degree) > 1 << 20)
+		{
+			row.segment /= 2;
+		}
+		while (int(steps.size()) <= row.degree)
+		{
+			steps.push_back(std::pow(dx, steps.size()));
+		}
+		int size = 0;
+		for (int k = 0; k <= row.degree; ++k)
+		{
+			row.offsets.push_back(size);
+			row.growth.push_back(DBL_EPSILON * growth(row.segment, row.degree - k));
+			size += row.degree - k + 1;
+		}
+		row.mid.resize(size);
+		row.rad.resize(size);
+		row.bound.resize(size);
+		row.diffs.resize(size);
+		row.bounds.resize(row.degree + 1);
+	}
+}
+
+void Scanline::beginRow(MathCtx* ctx, const Real& y)
+{
+	ctx->polys = values.data();
+	real_t h = y.max - y.min;
+	real_t c[maxDegree + 1], mid[maxDegree + 1], rad[maxDegree + 1];
+	for (size_t p = 0; p < rows.size(); ++p)
+	{
+		const Polynomial& poly = program->polys[p];
+		Row& row = rows[p];
+		for (int i = 0; i <= poly.degreeX; ++i)
+		{
+			/* The coefficient of x^i over the row is enclosed by its Taylor coefficients in y, like pixels are in x */
+			real_t lo = 0, hi = 0, hl = 1;
+			for (int l = 0; l <= poly.degreeY; ++l)
+			{
+				for (int j = l; j <= poly.degreeY; ++j)
+				{
+					c[j - l] = binomial(j, l) * poly.at(i, j);
+				}
+				real_t d = horner(c, poly.degreeY - l, y.min);
+				if (!l)
+				{
+					lo = hi = d;
+					continue;
+				}
+				hl *= h;
+				lo += std::min<real_t>(0, d * hl);
+				hi += std::max<real_t>(0, d * hl);
+			}
+			mid[i] = (lo + hi) / 2;
+			rad[i] = std::max(hi - mid[i], mid[i] - lo);
+		}
+		/* T_k(x) = sum binomial(t + k, k) c_{t + k} x^t */
+		for (int k = 0; k <= row.degree; ++k)
+		{
+			for (int t = 0; t <= row.degree - k; ++t)
+			{
+				real_t b = binomial(t + k, k);
+				row.mid[row.offsets[k] + t] = b * mid[t + k];
+				row.rad[row.offsets[k] + t] = b * rad[t + k];
+				row.bound[row.offsets[k] + t] = std::fabs(b * mid[t + k]);
+			}
+		}
+	}
+	px = -1;
+	for (auto& row : rows)
+	{
+		row.nextSeed = 0;
+	}
+	nextPixel();
+}
+
+void Scanline::nextPixel()
+{
+	++px;
+	for (size_t p = 0; p < rows.size(); ++p)
+	{
+		Row& row = rows[p];
+		if (px == row.nextSeed)
+		{
+			seed(row);
+			row.nextSeed = positive > px ? std::min(positive, px + row.segment) : px + row.segment;
+		}
+		else
+		{
+			advance(row);
+		}
+		values[p] = value(row);
+	}
+}
+
+void Scanline::seed(Row& row)
+{
+	real_t x = left + px * dx, sign = x < 0 ? -1 : 1;
+	/* The largest |x| until the next seed() */
+	real_t far = std::max(std::fabs(x), std::fabs(left + (px + row.segment + row.degree) * dx));
+	for (int k = 0; k <= row.degree; ++k)
+	{
+		int m = row.degree - k, o = row.offsets[k];
+		std::pair<real_t, real_t> *diff = &row.diffs[o];
+		/* Radii are taken at |x|, which is a polynomial until x changes its sign */
+		for (int s = 0; s <= m; ++s)
+		{
+			real_t xs = left + (px + s) * dx;
+			diff[s].first = horner(&row.mid[o], m, xs);
+			diff[s].second = horner(&row.rad[o], m, sign * xs);
+		}
+		for (int t = 1; t <= m; ++t)
+		{
+			for (int s = m; s >= t; --s)
+			{
+				diff[s].first -= diff[s - 1].first;
+				diff[s].second -= diff[s - 1].second;
+			}
+		}
+		row.bounds[k] = row.growth[k] * (horner(&row.bound[o], m, far) + horner(&row.rad[o], m, far));
+	}
+}
+
+void Scanline::advance(Row& row)
+{
+	std::pair<real_t, real_t> *diff = row.diffs.data();
+	for (int m = row.degree; m > 0; diff += m + 1, --m)
+	{
+		for (int s = 0; s < m; ++s)
+		{
+			diff[s].first += diff[s + 1].first;
+			diff[s].second += diff[s + 1].second;
+		}
+	}
+}
+
+Real Scanline::value(const Row& row) const
+{
+	const std::pair<real_t, real_t> *t = row.diffs.data();
+	real_t rad = t->second + row.bounds[0], lo = t->first - rad, hi = t->first + rad;
+	for (int k = 1; k <= row.degree; ++k)
+	{
+		t += row.degree - k + 2;
+		rad = t->second + row.bounds[k];
+		lo += std::min<real_t>(0, (t->first - rad) * steps[k]);
+		hi += std::max<real_t>(0, (t->first + rad) * steps[k]);
+	}
+	return Real(lo, hi);
+}
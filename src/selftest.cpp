@@ -0,0 +1,234 @@
+#include "gdrawer.hpp"
+#include <QTextStream>
+#include <algorithm>
+
+/* gdrawer --selftest runs checks of the renderer which need no files, its exit code is 1 if any of them fails.
+ * Every check returns a description of the failure, or a null string */
+
+namespace
+{
+	/* A factor which contains zero ends the linked code early. Native code has to report that as a result,
+	 * otherwise the interpreter evaluates the pixel again */
+	QString jitZeroFactor()
+	{
+		std::unique_ptr<Vm> vm(MathVm::get("(x - 1) * (y ^ 2 + 1) * (x + y + 100)"));
+		const MathVm *m = static_cast<const MathVm*>(&*vm);
+		if (m->factors.size() != 3)
+		{
+			return QString("the formula has %1 factors instead of 3").arg(m->factors.size());
+		}
+		if (!m->jit)
+		{
+			/* Nothing to check without a code generator */
+			return QString();
+		}
+		std::unique_ptr<Ctx> ctx(m->createCtx());
+		MathCtx *c = static_cast<MathCtx*>(&*ctx);
+		c->setVar('x', Real(0.5, 1.5));
+		c->setVar('y', Real(0, 1));
+		int status = runJit(&*m->jit, c->origStack.get(), c->vars.data(), c->polys);
+		if (status)
+		{
+			return QString("runJit() returned %1").arg(status);
+		}
+		if (!c->origStack[0].isZero())
+		{
+			return "the result does not contain zero";
+		}
+		return QString();
+	}
+
+	/* A factor within EPS of zero does not end the linked code, the product of this one is beyond EPS near
+	 * the origin. The linked code, natively and interpreted, has to agree with the plain product */
+	QString tinyFactor()
+	{
+		std::unique_ptr<Vm> vm(MathVm::get("(x ^ 2 + y ^ 2 + 5e-10) * (x + 1000)"));
+		const MathVm *m = static_cast<const MathVm*>(&*vm);
+		MathVm interpreted(*m), product;
+		interpreted.jit.reset();
+		for (size_t i = 0; i < m->factors.size(); ++i)
+		{
+			product.insert(product.end(), m->factors[i].begin(), m->factors[i].end());
+			if (i) product.emplace_back('*');
+		}
+		product.requiredStackSize = product.stackDepth();
+		product.compile();
+		std::unique_ptr<Ctx> ctx(m->createCtx());
+		MathCtx *c = static_cast<MathCtx*>(&*ctx);
+		const int cells = 16;
+		const real_t size = 0.01;
+		for (int i = -cells; i < cells; ++i)
+		{
+			for (int j = -cells; j < cells; ++j)
+			{
+				c->setVar('x', Real(i * size, (i + 1) * size));
+				c->setVar('y', Real(j * size, (j + 1) * size));
+				c->reset();
+				bool expected = product.execute(c).isZero();
+				c->reset();
+				bool linked = m->execute(c).isZero();
+				c->reset();
+				bool slow = interpreted.execute(c).isZero();
+				if (linked != expected || slow != expected)
+				{
+					return QString("the linked code gives %1 natively and %2 interpreted instead of %3 at (%4, %5)")
+						.arg(linked).arg(slow).arg(expected).arg(double(i * size)).arg(double(j * size));
+				}
+			}
+		}
+		return QString();
+	}
+
+	/* Renders with the cache and without it */
+	QString sameAsPlain(const QString& formula, const QRectF& rect, const QSize& viewport, FactorCache* cache)
+	{
+		std::unique_ptr<Vm> vm(MathVm::get(formula));
+		QImage plain = drawFormula(&*vm, rect, viewport), cached = drawFormula(&*vm, rect, viewport, NULL, cache);
+		for (int py = 0; py < viewport.height(); ++py)
+		{
+			for (int px = 0; px < viewport.width(); ++px)
+			{
+				if (plain.scanLine(py)[px] != cached.scanLine(py)[px])
+				{
+					return QString("pixel (%1, %2) of %3 differs").arg(px).arg(py).arg(formula);
+				}
+			}
+		}
+		return QString();
+	}
+
+	/* The window renders with a FactorCache, the picture has to be the one of a render without it. The second
+	 * formula is an edit of the first which shares all but its last factor. It comes after the states of the
+	 * first render are filled, and while they are still being filled */
+	QString cachedRender()
+	{
+		const char *formulas[] =
+		{
+			"(x ^ 2 + y ^ 2 - 25) * (x ^ 3 - 3 * x * y ^ 2 - y - 2) * ((x - 1) ^ 4 + (y + 2) ^ 4 - 3) * (x * y - 1)",
+			"(x ^ 2 + y ^ 2 - 25) * (x ^ 3 - 3 * x * y ^ 2 - y - 2) * ((x - 1) ^ 4 + (y + 2) ^ 4 - 3) * (x * y + 1)",
+		};
+		QRectF rect(QPointF(-7.3, -6.1), QPointF(8.2, 5.9));
+		QSize viewport(437, 311);
+		std::unique_ptr<Vm> first(MathVm::get(formulas[0]));
+		const auto& factors = static_cast<const MathVm*>(&*first)->factors;
+		for (int finish = 1; finish >= 0; --finish)
+		{
+			FactorCache cache;
+			QString error = sameAsPlain(formulas[0], rect, viewport, &cache);
+			if (!error.isNull())
+			{
+				return error;
+			}
+			if (finish)
+			{
+				finishFactorCache(&cache);
+				auto filled = cache.factors;
+				/* Every pixel evaluates the first factor */
+				auto states = filled[MathVm::codeHash(factors[0])];
+				if (!states || std::count(states->begin(), states->end(), 0))
+				{
+					return "the first render did not fill the states of its first factor";
+				}
+				error = sameAsPlain(formulas[1], rect, viewport, &cache);
+				for (size_t i = 0; i + 1 < factors.size() && error.isNull(); ++i)
+				{
+					quint64 key = MathVm::codeHash(factors[i]);
+					if (!cache.factors.count(key) || cache.factors[key] != filled[key])
+					{
+						error = QString("the edit did not reuse factor %1").arg(i);
+					}
+				}
+			}
+			else
+			{
+				error = sameAsPlain(formulas[1], rect, viewport, &cache);
+			}
+			if (!error.isNull())
+			{
+				return error;
+			}
+			error = sameAsPlain(formulas[0], rect, viewport, &cache);
+			if (!error.isNull())
+			{
+				return error;
+			}
+		}
+		return QString();
+	}
+
+	/* Code specialized to ranges of the variables has to give values within the ones of the original
+	 * code, for cells within the ranges. The ranges are the ones of a band of rows */
+	QString specializedBand()
+	{
+		const char *formula = "|x| * (y ^ 2 + 1) / |y + 1| + (x - 1) * (x - 1) - |y - 3| * x ^ 3";
+		std::unique_ptr<Vm> vm(MathVm::get(formula));
+		const MathVm *m = static_cast<const MathVm*>(&*vm);
+		std::array<Real, 26> vars;
+		vars.fill(Real(-INFINITY, INFINITY));
+		vars['x' - 'a'] = Real(-2, 3);
+		vars['y' - 'a'] = Real(1, 2);
+		std::shared_ptr<MathVm> specialized = m->specialize(vars);
+		if (!specialized)
+		{
+			return qEnvironmentVariableIsSet("GDRAWER_NO_SPECIALIZE") ? QString() : "nothing was specialized";
+		}
+		std::unique_ptr<Ctx> ctx(m->createCtx());
+		MathCtx *c = static_cast<MathCtx*>(&*ctx);
+		const int cells = 64;
+		for (int i = 0; i < cells; ++i)
+		{
+			for (int j = 0; j < cells; ++j)
+			{
+				real_t x = -2 + 5.0 * i / cells, y = 1 + 1.0 * j / cells;
+				c->setVar('x', Real(x, x + 5.0 / cells));
+				c->setVar('y', Real(y, y + 1.0 / cells));
+				c->reset();
+				Real a = m->execute(c);
+				c->reset();
+				Real b = specialized->execute(c);
+				if (b.min < a.min || b.max > a.max)
+				{
+					return QString("[%1, %2] is not within [%3, %4] at (%5, %6)").arg(double(b.min)).arg(double(b.max))
+						.arg(double(a.min)).arg(double(a.max)).arg(double(x)).arg(double(y));
+				}
+			}
+		}
+		return QString();
+	}
+}
+
+int runSelfTest()
+{
+	QTextStream out(stdout);
+	std::vector<std::pair<QString, std::function<QString()>>> checks =
+	{
+		{ "jit zero factor", jitZeroFactor },
+		{ "tiny factor", tinyFactor },
+		{ "cached render", cachedRender },
+		{ "specialized band", specializedBand },
+	};
+	int failed = 0;
+	for (auto& check : checks)
+	{
+		QString error;
+		try
+		{
+			error = check.second();
+		}
+		catch (Exception e)
+		{
+			error = e.what();
+		}
+		if (error.isNull())
+		{
+			out << "ok      " << check.first << "\n";
+		}
+		else
+		{
+			out << "FAILED  " << check.first << ": " << error << "\n";
+			++failed;
+		}
+	}
+	out << (failed ? QString("%1 of %2 checks failed\n").arg(failed).arg(checks.size()) : QString("All checks passed\n"));
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,401 @@
+#include "gdrawer.hpp"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QElapsedTimer>
+#include <QBuffer>
+#include <QTextStream>
+#include <QDebug>
+
+/* Requests and replies are JSON objects, one per line. Clients connected over TCP may only send
+ * math formulas as text and get the picture in the reply, at most maxRemoteSize pixels wide and high.
+ * The server renders at most maxRemoteRequests of their requests at a time, the others wait. A client over
+ * TCP has at most maxRemotePending requests in flight, its further lines are read as replies go out, and
+ * it is disconnected when a line is longer than maxRemoteLine bytes.
+ * Request fields:
+ *   formula or file   formula or program text, or a file to read it from (a .gdvm file for the math backend)
+ *   backend           "math" (default), "pascal" or "cpp"
+ *   isolated          run native code in worker processes
+ *   rect              [x1, y1, x2, y2], defaults to the #! line of the file or -10 -10 10 10
+ *   size              [width, height], defaults to [512, 512]
+ *   output            save the picture to this file instead of returning it
+ *   stats             return only the statistics
+ *   raw               return the pixels as base64 bytes, 0 empty, 1 curve, 2 not rendered, row by row
+ *   id                copied to the reply
+ * Reply fields: id, ok, error, width, height, pixels (number of curve pixels), cached,
+ *   compileMs, renderMs, warnings, output, image (base64 PNG) or raw */
+
+namespace
+{
+	const int maxSize = 16384;
+	const int maxRemoteSize = 2048;
+	const int maxRemoteRequests = 2;
+	const int maxRemotePending = 4;
+	const int maxRemoteLine = 64 * 1024;
+
+	class Request : public QRunnable
+	{
+		public:
+			Request(RenderServer* _server, quint64 _client, const QByteArray& _line, bool _isRemote):
+				server(_server), client(_client), line(_line), isRemote(_isRemote) {}
+			void run()
+			{
+				QByteArray reply = server->handle(line, isRemote);
+				QMetaObject::invokeMethod(server, "send", Qt::QueuedConnection,
+					Q_ARG(quint64, client), Q_ARG(QByteArray, reply));
+			}
+		private:
+			RenderServer *server;
+			quint64 client;
+			QByteArray line;
+			bool isRemote;
+	};
+}
+
+RenderServer::RenderServer(int _cacheSize): server(new QLocalServer(this)), tcpServer(new QTcpServer(this)),
+	remotePool(new QThreadPool(this)), cacheSize(_cacheSize), lastClient(0)
+{
+	remotePool->setMaxThreadCount(maxRemoteRequests);
+	connect(server, SIGNAL(newConnection()), this, SLOT(accept()));
+	connect(tcpServer, SIGNAL(newConnection()), this, SLOT(acceptTcp()));
+}
+
+bool RenderServer::listen(const QString& name)
+{
+	int colon = name.lastIndexOf(':');
+	if (colon >= 0)
+	{
+		QString host = name.left(colon);
+		if (!tcpServer->listen(host.isEmpty() ? QHostAddress(QHostAddress::LocalHost) : QHostAddress(host), name.mid(colon + 1).toUShort()))
+		{
+			qWarning() << "Cannot listen on" << name << tcpServer->errorString();
+			return false;
+		}
+		return true;
+	}
+	QLocalServer::removeServer(name);
+	if (!server->listen(name))
+	{
+		qWarning() << "Cannot listen on" << name << server->errorString();
+		return false;
+	}
+	return true;
+}
+
+void RenderServer::addClient(QIODevice* socket, bool isRemote)
+{
+	quint64 id = ++lastClient;
+	clients[id] = socket;
+	remote[id] = isRemote;
+	connect(socket, &QIODevice::readyRead, [this, id]() { this->read(id); });
+	auto drop = [this, id]()
+	{
+		this->remote.remove(id);
+		this->pending.remove(id);
+		this->clients.take(id)->deleteLater();
+	};
+	if (auto local = qobject_cast<QLocalSocket*>(socket))
+	{
+		connect(local, &QLocalSocket::disconnected, drop);
+	}
+	else
+	{
+		auto tcp = static_cast<QTcpSocket*>(socket);
+		/* A full buffer without a newline holds a line which is too long */
+		tcp->setReadBufferSize(maxRemoteLine + 1);
+		connect(tcp, &QTcpSocket::disconnected, drop);
+	}
+}
+
+void RenderServer::accept()
+{
+	while (QLocalSocket *socket = server->nextPendingConnection())
+	{
+		addClient(socket, false);
+	}
+}
+
+void RenderServer::acceptTcp()
+{
+	while (QTcpSocket *socket = tcpServer->nextPendingConnection())
+	{
+		addClient(socket, true);
+	}
+}
+
+void RenderServer::read(quint64 client)
+{
+	QIODevice *socket = clients.value(client);
+	if (!socket)
+	{
+		return;
+	}
+	bool isRemote = remote.value(client);
+	while (socket->canReadLine() && (!isRemote || pending.value(client) < maxRemotePending))
+	{
+		++pending[client];
+		(isRemote ? remotePool : QThreadPool::globalInstance())->start(new Request(this, client, socket->readLine(), isRemote));
+	}
+	if (isRemote && !socket->canReadLine() && socket->bytesAvailable() > maxRemoteLine)
+	{
+		qWarning() << "Disconnecting a client whose request is longer than" << maxRemoteLine << "bytes";
+		static_cast<QTcpSocket*>(socket)->abort();
+	}
+}
+
+void RenderServer::send(quint64 client, QByteArray reply)
+{
+	if (QIODevice *socket = clients.value(client))
+	{
+		socket->write(reply);
+		--pending[client];
+		/* Lines of a remote client wait while it has too many requests in flight */
+		read(client);
+	}
+}
+
+std::shared_ptr<Vm> RenderServer::getVm(const QString& backend, const QString& source, bool isolated, bool compiled,
+	const QRectF& rect, bool* cached)
+{
+	QString key = QString("%1:%2:%3:%4").arg(backend).arg(isolated).arg(compiled).arg(source);
+	/* Moves the entry of key to the front, callers hold cacheMutex */
+	auto find = [&]() -> std::shared_ptr<Vm>
+	{
+		for (auto i = cache.begin(); i != cache.end(); ++i)
+		{
+			if (i->first == key)
+			{
+				cache.splice(cache.begin(), cache, i);
+				return cache.front().second;
+			}
+		}
+		return nullptr;
+	};
+	{
+		QMutexLocker lock(&cacheMutex);
+		if (std::shared_ptr<Vm> vm = find())
+		{
+			*cached = true;
+			return vm;
+		}
+	}
+
+	*cached = false;
+	std::shared_ptr<Vm> vm;
+	if (backend == "math" && compiled)
+		vm.reset(MathVm::load(source));
+	else if (backend == "math")
+		vm.reset(MathVm::get(source));
+	else if (backend == "pascal")
+		vm.reset(getPascalVm(source, isolated));
+	else if (backend == "cpp")
+		vm.reset(getCppVm(source, isolated));
+	else
+		throw Exception(QString("Unknown backend: %1").arg(backend));
+	/* The factor order is fixed by the first rect the formula is drawn in, as the Vm is shared */
+	if (auto m = dynamic_cast<MathVm*>(&*vm))
+	{
+		m->calibrate(rect);
+	}
+
+	QMutexLocker lock(&cacheMutex);
+	/* Another request may have compiled the same formula meanwhile */
+	if (std::shared_ptr<Vm> other = find())
+	{
+		return other;
+	}
+	cache.emplace_front(key, vm);
+	while (int(cache.size()) > cacheSize)
+	{
+		cache.pop_back();
+	}
+	return vm;
+}
+
+QByteArray RenderServer::handle(const QByteArray& line, bool isRemote)
+{
+	QJsonObject reply;
+	try
+	{
+		QJsonParseError error;
+		QJsonDocument doc = QJsonDocument::fromJson(line, &error);
+		if (!doc.isObject())
+		{
+			throw Exception(QString("Invalid request: %1").arg(error.errorString()));
+		}
+		const QJsonObject request = doc.object();
+		reply["id"] = request["id"];
+
+		QString backend = request["backend"].toString("math"), source;
+		if (isRemote && (backend != "math" || request.contains("file") || request.contains("output")))
+		{
+			throw Exception("Remote clients may only send formulas");
+		}
+		QStringList parts;
+		/* Only files are loaded from disk, a formula is always text */
+		bool compiled = false;
+		if (request.contains("file"))
+		{
+			QString file = request["file"].toString();
+			compiled = backend == "math" && file.endsWith(".gdvm");
+			if (compiled)
+				source = file;
+			else if (backend == "math")
+				source = readFormula(file, &parts);
+			else
+				source = readFile(file);
+		}
+		else
+		{
+			source = request["formula"].toString();
+		}
+
+		QRectF rect(QPointF(-10, -10), QPointF(10, 10));
+		QJsonArray r = request["rect"].toArray();
+		if (r.size() == 4)
+		{
+			rect = QRectF(QPointF(r[0].toDouble(), r[1].toDouble()), QPointF(r[2].toDouble(), r[3].toDouble()));
+		}
+		else if (parts.size() == 4)
+		{
+			rect = QRectF(QPointF(parts[0].toDouble(), parts[1].toDouble()), QPointF(parts[2].toDouble(), parts[3].toDouble()));
+		}
+		QJsonArray s = request["size"].toArray();
+		QSize size(512, 512);
+		if (s.size() == 2)
+		{
+			size = QSize(s[0].toInt(), s[1].toInt());
+		}
+		int limit = isRemote ? maxRemoteSize : maxSize;
+		if (size.width() < 1 || size.height() < 1 || size.width() > limit || size.height() > limit)
+		{
+			throw Exception(QString("Invalid size, the limit is %1x%1").arg(limit));
+		}
+
+		QElapsedTimer timer;
+		timer.start();
+		bool cached;
+		std::shared_ptr<Vm> vm = getVm(backend, source, request["isolated"].toBool(), compiled, rect, &cached);
+		reply["cached"] = cached;
+		reply["compileMs"] = timer.nsecsElapsed() / 1e6;
+
+		timer.start();
+		QImage img;
+		if (auto isolated = dynamic_cast<const IsolatedVm*>(&*vm))
+		{
+			QStringList errors;
+			img = drawIsolated(isolated, rect, size, 5000, &errors);
+			if (!errors.isEmpty())
+			{
+				reply["warnings"] = QJsonArray::fromStringList(errors);
+			}
+		}
+		else
+		{
+			img = drawFormula(&*vm, rect, size);
+		}
+		reply["renderMs"] = timer.nsecsElapsed() / 1e6;
+
+		qint64 pixels = 0;
+		for (int y = 0; y < img.height(); ++y)
+		{
+			const uchar *line = img.constScanLine(y);
+			for (int x = 0; x < img.width(); ++x)
+			{
+				pixels += line[x] == 1;
+			}
+		}
+		reply["width"] = img.width();
+		reply["height"] = img.height();
+		reply["pixels"] = pixels;
+
+		if (request.contains("output"))
+		{
+			QString output = request["output"].toString();
+			if (!img.save(output))
+			{
+				throw Exception(QString("Cannot save %1").arg(output));
+			}
+			reply["output"] = output;
+		}
+		else if (request["raw"].toBool())
+		{
+			QByteArray raw;
+			for (int y = 0; y < img.height(); ++y)
+			{
+				raw.append(reinterpret_cast<const char*>(img.constScanLine(y)), img.width());
+			}
+			reply["raw"] = QString::fromLatin1(raw.toBase64());
+		}
+		else if (!request["stats"].toBool())
+		{
+			QByteArray png;
+			QBuffer buffer(&png);
+			buffer.open(QIODevice::WriteOnly);
+			img.save(&buffer, "PNG");
+			reply["image"] = QString::fromLatin1(png.toBase64());
+		}
+		reply["ok"] = true;
+	}
+	catch (Exception e)
+	{
+		reply["ok"] = false;
+		reply["error"] = e.what();
+	}
+	return QJsonDocument(reply).toJson(QJsonDocument::Compact) + '\n';
+}
+
+QIODevice* connectToServer(const QString& name, int timeout, QString* error)
+{
+	int colon = name.lastIndexOf(':');
+	if (colon >= 0)
+	{
+		std::unique_ptr<QTcpSocket> socket(new QTcpSocket);
+		socket->connectToHost(name.left(colon), name.mid(colon + 1).toUShort());
+		if (!socket->waitForConnected(timeout))
+		{
+			*error = QString("Cannot connect to %1: %2").arg(name).arg(socket->errorString());
+			return NULL;
+		}
+		return socket.release();
+	}
+	std::unique_ptr<QLocalSocket> socket(new QLocalSocket);
+	socket->connectToServer(name);
+	if (!socket->waitForConnected(timeout))
+	{
+		*error = QString("Cannot connect to %1: %2").arg(name).arg(socket->errorString());
+		return NULL;
+	}
+	return socket.release();
+}
+
+int runRenderClient(const QString& name, const QString& request)
+{
+	QTextStream out(stdout);
+	QString error;
+	std::unique_ptr<QIODevice> socket(connectToServer(name, 5000, &error));
+	if (!socket)
+	{
+		out << error << "\n";
+		return 1;
+	}
+	socket->write(request.trimmed().toUtf8() + '\n');
+	while (!socket->canReadLine())
+	{
+		if (!socket->waitForReadyRead(-1))
+		{
+			out << "Connection lost: " << socket->errorString() << "\n";
+			return 1;
+		}
+	}
+	QByteArray reply = socket->readLine();
+	out << reply;
+	return QJsonDocument::fromJson(reply).object()["ok"].toBool() ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+#include "gdrawer.hpp"
+
+/* The code is run once on ranges: the range of an operand contains every value it takes while the variables
+ * stay within theirs, since interval arithmetic is inclusion monotone. Where the ranges decide a branch of
+ * RangeReal, the instruction is replaced by one without the branch:
+ *   D *  Q  square, which is never negative
+ *   *    p  product of non-negative intervals, [a.min * b.min, a.max * b.max]
+ *   |       dropped for positive operands, m for negative ones
+ *   /    d  division by intervals without zero
+ * P loads Taylor forms from a Scanline, which may be wider than the range of the polynomial, so they are not bounded */
+
+namespace
+{
+	const Real anything(-INFINITY, INFINITY);
+
+	/* NaNs come from infinite ranges, they bound nothing */
+	Real bounded(const Real& r)
+	{
+		return std::isnan(r.min) || std::isnan(r.max) ? anything : r;
+	}
+
+	/* Contains RangeReal::pow() of every base within the range, for constant non-negative integer exponents */
+	Real powRange(const Real& base, const Real& exponent)
+	{
+		int n = exponent.max;
+		if (exponent.min != exponent.max || n < 0 || n != exponent.max)
+		{
+			return anything;
+		}
+		if (!n)
+		{
+			/* RangeReal::pow() gives [0, 1] for bases around zero */
+			return Real(0, 1);
+		}
+		if (n % 2)
+		{
+			return Real(std::pow(base.min, n), std::pow(base.max, n));
+		}
+		Real m = base.abs();
+		return Real(std::pow(m.min, n), std::pow(m.max, n));
+	}
+}
+
+std::shared_ptr<MathVm> MathVm::specialize(const std::array<Real, 26>& vars) const
+{
+	if (qEnvironmentVariableIsSet("GDRAWER_NO_SPECIALIZE"))
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<MathVm> ret(new MathVm);
+	std::vector<Real> stack;
+	bool changed = false;
+	for (size_t k = 0; k < size(); ++k)
+	{
+		Instr i = (*this)[k];
+		int needs, pushes;
+		stackEffect(i, &needs, &pushes);
+		if (int(stack.size()) < needs)
+		{
+			throw Exception("Stack underflow in bytecode");
+		}
+		Real a, b;
+		switch (i.type)
+		{
+			case 'C':
+				stack.push_back(i.val);
+				break;
+			case 'V':
+				stack.push_back(vars[static_cast<int>(i.arg)]);
+				break;
+			case 'P':
+				stack.push_back(anything);
+				break;
+			case 'D':
+				if (k + 1 < size() && (*this)[k + 1].type == '*')
+				{
+					i = Instr('Q', 0, 0, i.begin, (*this)[++k].end);
+					stack.back() = bounded(stack.back().square());
+					changed = true;
+				}
+				else
+				{
+					stack.push_back(stack.back());
+				}
+				break;
+			case 'S':
+				std::swap(stack[stack.size() - 1], stack[stack.size() - 2]);
+				break;
+			case 'm':
+				stack.back() = -stack.back();
+				break;
+			case 'Q':
+				stack.back() = bounded(stack.back().square());
+				break;
+			case '|':
+				a = stack.back();
+				if (a.min > EPS)
+				{
+					changed = true;
+					continue;
+				}
+				if (a.max < -EPS)
+				{
+					i.type = 'm';
+					changed = true;
+				}
+				stack.back() = a.abs();
+				break;
+			case 'Z':
+				break;
+			default:
+				b = stack.back();
+				stack.pop_back();
+				a = stack.back();
+				if (i.type == '+')
+				{
+					a = a + b;
+				}
+				else if (i.type == '-')
+				{
+					a = a - b;
+				}
+				else if (i.type == '*' || i.type == 'p')
+				{
+					if (a.min >= 0 && b.min >= 0 && i.type == '*')
+					{
+						i.type = 'p';
+						changed = true;
+					}
+					a = a * b;
+				}
+				else if (i.type == '/' || i.type == 'd')
+				{
+					if (b.isZero())
+					{
+						a = anything;
+					}
+					else
+					{
+						changed = changed || i.type == '/';
+						i.type = 'd';
+						a = a.divide(b);
+					}
+				}
+				else
+				{
+					a = powRange(a, b);
+				}
+				stack.back() = bounded(a);
+				break;
+		}
+		ret->push_back(i);
+	}
+	if (!changed)
+	{
+		return nullptr;
+	}
+
+	ret->requiredStackSize = requiredStackSize;
+	ret->polys = polys;
+	ret->verify();
+	ret->compile();
+	return ret;
+}
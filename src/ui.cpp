@@ -1,8 +1,15 @@
 #include "gdrawer.hpp"
 #include <QtWidgets>
 
-MainWindow::MainWindow()
+MainWindow::MainWindow(): needFit(false), fitRequested(false)
 {
+	watcher = new QFileSystemWatcher(this);
+	connect(watcher, SIGNAL(fileChanged(QString)), this, SLOT(fileChanged(QString)));
+	redrawTimer = new QTimer(this);
+	redrawTimer->setSingleShot(true);
+	redrawTimer->setInterval(50);
+	connect(redrawTimer, SIGNAL(timeout()), this, SLOT(draw()));
+
 	picture = new QLabel;
 
 	QHBoxLayout *layout = new QHBoxLayout;
@@ -30,6 +37,27 @@ MainWindow::MainWindow()
 	connect(drawButton, SIGNAL(clicked()), this, SLOT(draw()));
 	form->addRow(drawButton);
 
+	param = new QLineEdit("t");
+	paramFrom = new QLineEdit("0");
+	paramTo = new QLineEdit("1");
+	frames = new QLineEdit("25");
+	form->addRow(tr("Parameter"), param);
+	form->addRow(tr("From"), paramFrom);
+	form->addRow(tr("To"), paramTo);
+	form->addRow(tr("Frames"), frames);
+
+	QPushButton *fitButton = new QPushButton(tr("Find curve"));
+	connect(fitButton, SIGNAL(clicked()), this, SLOT(fit()));
+	form->addRow(fitButton);
+
+	QPushButton *sweepButton = new QPushButton(tr("Render sweep"));
+	connect(sweepButton, SIGNAL(clicked()), this, SLOT(sweep()));
+	form->addRow(sweepButton);
+
+	QPushButton *profileButton = new QPushButton(tr("Profile formula"));
+	connect(profileButton, SIGNAL(clicked()), this, SLOT(profile()));
+	form->addRow(profileButton);
+
 	QPushButton *viewButton = new QPushButton(tr("View solution"));
 	connect(viewButton, SIGNAL(clicked()), this, SLOT(view()));
 	form->addRow(viewButton);
@@ -40,6 +68,15 @@ MainWindow::MainWindow()
 	type->addItem("C++");
 	form->addRow(type);
 
+	isolate = new QCheckBox(tr("Run native code in worker processes"));
+	form->addRow(isolate);
+
+	lattice = new QCheckBox(tr("Draw boundaries of native code regions"));
+	form->addRow(lattice);
+
+	certify = new QCheckBox(tr("Trace curves through cells where the formula is monotone"));
+	form->addRow(certify);
+
 	layout->addLayout(form);
 	setLayout(layout);
 
@@ -60,7 +97,7 @@ void MainWindow::open()
 {
 	QString ext;
 	if (type->currentIndex() == 0)
-		ext = "Text file (*.txt)";
+		ext = "Text file (*.txt);;Compiled formula (*.gdvm)";
 	else if (type->currentIndex() == 1) 
 		ext = "Pascal file (*.pas)";
 	else if (type->currentIndex() == 2)
@@ -78,11 +115,31 @@ void MainWindow::open(QString name)
 		return;
 	}
 	
+	if (!watcher->files().isEmpty())
+	{
+		watcher->removePaths(watcher->files());
+	}
+	if (!name.startsWith(':'))
+	{
+		watcher->addPath(name);
+	}
 	path = name;
 	pathLabel->setText(QFileInfo(name).fileName());
+	needFit = true;
+	cache = FactorCache();
+}
+
+void MainWindow::fileChanged(const QString& name)
+{
+	/* Editors which replace the file remove it from the watcher */
+	if (!watcher->files().contains(name) && QFile::exists(name))
+	{
+		watcher->addPath(name);
+	}
+	redrawTimer->start();
 }
 
-static QString readFile(const QString& filename)
+QString readFile(const QString& filename)
 {
 	QFile f(filename);
 	if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
@@ -90,34 +147,22 @@ static QString readFile(const QString& filename)
 	return QString::fromUtf8(f.readAll());
 }
 
-QString MainWindow::getFormula(const QString& filename)
+QString readFormula(const QString& filename, QStringList* rect, std::vector<int>* lines)
 {
 	QString formula;
 	QFile f(filename);
 	f.open(QIODevice::ReadOnly | QIODevice::Text);
-	int lineNumber = 0;
+	int lineNumber = 0, fileLine = 0;
 	while (!f.atEnd())
 	{
 		QString line = QString::fromUtf8(f.readLine());
+		++fileLine;
 		if (line.startsWith("#!"))
 		{
 			line.remove(0, 2);
 			QStringList parts = line.split(QRegExp("\\s+"), QString::SkipEmptyParts);
 			qDebug() << parts;
-			if (parts.size() != 4) continue;
-			QLineEdit *order[] = { x1, y1, x2, y2 };
-			for (int i = 0; i < 4; ++i)
-			{
-				bool ok = true;
-				parts[i].toDouble(&ok);
-				if (!ok)
-				{
-					QMessageBox::warning(this, tr("GDrawer"), tr("Rect sizes are invalid"));
-					resetRect();
-					break;
-				}
-				order[i]->setText(parts[i]);
-			}
+			if (parts.size() == 4 && rect) *rect = parts;
 			continue;
 		}
 		if (line.startsWith('#'))
@@ -127,27 +172,175 @@ QString MainWindow::getFormula(const QString& filename)
 		if (lineNumber) formula.append('\n');
 		formula.append(line);
 		++lineNumber;
+		if (lines) lines->resize(formula.toUtf8().size(), fileLine);
+	}
+	return formula;
+}
+
+QString MainWindow::getFormula(const QString& filename, bool* hasRect)
+{
+	QStringList parts;
+	QString formula = readFormula(filename, &parts);
+	if (hasRect) *hasRect = parts.size() == 4;
+	if (parts.size() == 4)
+	{
+		QLineEdit *order[] = { x1, y1, x2, y2 };
+		for (int i = 0; i < 4; ++i)
+		{
+			bool ok = true;
+			parts[i].toDouble(&ok);
+			if (!ok)
+			{
+				QMessageBox::warning(this, tr("GDrawer"), tr("Rect sizes are invalid"));
+				resetRect();
+				break;
+			}
+			order[i]->setText(parts[i]);
+		}
 	}
 	return formula;
 }
 
+Vm* MainWindow::loadVm(QRectF* rect)
+{
+	std::unique_ptr<Vm> ret;
+	bool hasRect = false;
+	if (type->currentIndex() == 0 && path.endsWith(".gdvm"))
+		ret.reset(MathVm::load(path));
+	else if (type->currentIndex() == 0)
+		ret.reset(MathVm::get(getFormula(path, &hasRect))); // GetFormula sets x, y
+	else if (type->currentIndex() == 1)
+		ret.reset(getPascalVm(readFile(path), isolate->isChecked()));
+	else
+		ret.reset(getCppVm(readFile(path), isolate->isChecked()));
+
+	*rect = QRectF(
+		QPointF(x1->text().toDouble(), y1->text().toDouble()),
+		QPointF(x2->text().toDouble(), y2->text().toDouble()));
+	if (auto m = dynamic_cast<MathVm*>(&*ret))
+	{
+		/* A freshly opened formula without a rect is looked for in the whole plane */
+		if (fitRequested || (needFit && !hasRect))
+		{
+			QRectF fit = fitViewport(m);
+			if (!fit.isNull())
+			{
+				/* Keep the aspect ratio of the picture */
+				QSizeF size = QSizeF(picture->size()).scaled(fit.size(), Qt::KeepAspectRatioByExpanding);
+				*rect = QRectF(fit.center() - QPointF(size.width() / 2, size.height() / 2), size);
+				x1->setText(QString::number(rect->left()));
+				y1->setText(QString::number(rect->top()));
+				x2->setText(QString::number(rect->right()));
+				y2->setText(QString::number(rect->bottom()));
+			}
+		}
+		m->calibrate(*rect);
+	}
+	needFit = fitRequested = false;
+	return ret.release();
+}
+
 void MainWindow::draw()
 {
 	try
 	{
-		std::unique_ptr<Vm> f;
-		if (type->currentIndex() == 0)
-			f.reset(MathVm::get(getFormula(path))); // GetFormula sets x, y
-		else if (type->currentIndex() == 1)
-			f.reset(getPascalVm(readFile(path)));
-		else if (type->currentIndex() == 2)
-			f.reset(getCppVm(readFile(path)));
-
-		QRectF rect(
-			QPointF(x1->text().toDouble(), y1->text().toDouble()),
-			QPointF(x2->text().toDouble(), y2->text().toDouble()));
-
-		picture->setPixmap(QPixmap::fromImage(drawFormula(&*f, rect, picture->size())));
+		QRectF rect;
+		std::unique_ptr<Vm> f(loadVm(&rect));
+
+		if (auto isolated = dynamic_cast<const IsolatedVm*>(&*f))
+		{
+			QStringList errors;
+			picture->setPixmap(QPixmap::fromImage(drawIsolated(isolated, rect, picture->size(), 5000, &errors)));
+			if (!errors.isEmpty())
+			{
+				QMessageBox::warning(this, tr("GDrawer"), errors.join("\n"));
+			}
+			return;
+		}
+		if (auto native = dynamic_cast<const PascalVm*>(&*f))
+		{
+			if (lattice->isChecked())
+			{
+				picture->setPixmap(QPixmap::fromImage(drawLattice(native, rect, picture->size())));
+				return;
+			}
+		}
+		auto math = dynamic_cast<const MathVm*>(&*f);
+		if (math && certify->isChecked())
+		{
+			picture->setPixmap(QPixmap::fromImage(drawCertified(math, rect, picture->size())));
+			return;
+		}
+		picture->setPixmap(QPixmap::fromImage(drawFormula(&*f, rect, picture->size(), NULL, &cache)));
+	}
+	catch (Exception e)
+	{
+		QMessageBox::critical(this, tr("Error"), e.what());
+	}
+}
+
+void MainWindow::fit()
+{
+	fitRequested = true;
+	draw();
+	fitRequested = false;
+}
+
+void MainWindow::sweep()
+{
+	try
+	{
+		QString name = param->text().trimmed().toLower();
+		if (name.size() != 1 || name[0] < 'a' || name[0] > 'z' || name == "x" || name == "y")
+		{
+			throw Exception("Parameter must be a single letter other than x and y");
+		}
+		bool ok1 = true, ok2 = true, ok3 = true;
+		real_t from = paramFrom->text().toDouble(&ok1), to = paramTo->text().toDouble(&ok2);
+		int count = frames->text().toInt(&ok3);
+		if (!ok1 || !ok2 || !ok3)
+		{
+			throw Exception("Sweep range is invalid");
+		}
+
+		QString dir = QFileDialog::getExistingDirectory(this, tr("Save frames to"));
+		if (dir.isEmpty()) return;
+
+		QRectF rect;
+		std::unique_ptr<Vm> f(loadVm(&rect));
+
+		drawSweep(&*f, rect, picture->size(), name[0].toLatin1(), from, to, count, dir);
+	}
+	catch (Exception e)
+	{
+		QMessageBox::critical(this, tr("Error"), e.what());
+	}
+}
+
+void MainWindow::profile()
+{
+	try
+	{
+		QRectF rect;
+		std::unique_ptr<Vm> f(loadVm(&rect));
+		auto m = dynamic_cast<const MathVm*>(&*f);
+		if (!m)
+		{
+			throw Exception("Only formulas can be profiled");
+		}
+		/* Compiled formulas have no source */
+		std::vector<int> lines;
+		QString source = path.endsWith(".gdvm") ? QString() : readFormula(path, NULL, &lines);
+		QString report = profileReport(m, profileFormula(m, rect, picture->size()), source, lines);
+
+		QTextEdit *text = new QTextEdit;
+		text->setAttribute(Qt::WA_DeleteOnClose);
+		text->setReadOnly(true);
+		text->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+		text->setPlainText(report);
+		text->setWindowTitle(tr("Profile of %1").arg(QFileInfo(path).fileName()));
+		text->resize(800, 600);
+		text->show();
 	}
 	catch (Exception e)
 	{
@@ -159,7 +352,8 @@ void MainWindow::view()
 {
 	auto form = new FileEditor(path);
 	form->setAttribute(Qt::WA_DeleteOnClose);
-	connect(form, SIGNAL(saved()), this, SLOT(draw()));
+	/* The watcher sees this save too, the timer merges both into one redraw */
+	connect(form, SIGNAL(saved()), redrawTimer, SLOT(start()));
 	form->show();
 }
 
@@ -1,14 +1,20 @@
 #include "gdrawer.hpp"
 #include <QDebug>
+#include <algorithm>
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
 
 void const_t::addInstr(MathVm* instrs) const
 {
-	instrs->emplace_back('C', 0, val);
+	instrs->emplace_back('C', 0, val, begin, end);
 }
 
 void var_t::addInstr(MathVm* instrs) const
 {
-	instrs->emplace_back('V', name - 'a');
+	instrs->emplace_back('V', name - 'a', 0, begin, end);
 }
 
 void binop_t::addInstr(MathVm* instrs) const
@@ -24,11 +30,11 @@ void binop_t::addInstr(MathVm* instrs) const
 				l->addInstr(instrs);
 				for (int i = 1; i < p; ++i)
 				{
-					instrs->emplace_back('D');
+					instrs->emplace_back('D', 0, 0, begin, end);
 				}
 				for (int i = 1; i < p; ++i)
 				{
-					instrs->emplace_back('*');
+					instrs->emplace_back('*', 0, 0, begin, end);
 				}
 				return;
 			}
@@ -43,10 +49,10 @@ void binop_t::addInstr(MathVm* instrs) const
 			if (l2->l->equalsTo(&*r))
 			{
 				r->addInstr(instrs);
-				instrs->emplace_back('D');
-				instrs->emplace_back(l2->opcode());
-				if (op == '-') instrs->emplace_back('S');
-				instrs->emplace_back(op);
+				instrs->emplace_back('D', 0, 0, l2->begin, l2->end);
+				instrs->emplace_back(l2->opcode(), 0, 0, l2->begin, l2->end);
+				if (op == '-') instrs->emplace_back('S', 0, 0, begin, end);
+				instrs->emplace_back(op, 0, 0, begin, end);
 				return;
 			}
 		}
@@ -56,9 +62,9 @@ void binop_t::addInstr(MathVm* instrs) const
 			if (l->equalsTo(&*r2->l))
 			{
 				l->addInstr(instrs);
-				instrs->emplace_back('D');
-				instrs->emplace_back(r2->opcode());
-				instrs->emplace_back(op);
+				instrs->emplace_back('D', 0, 0, r2->begin, r2->end);
+				instrs->emplace_back(r2->opcode(), 0, 0, r2->begin, r2->end);
+				instrs->emplace_back(op, 0, 0, begin, end);
 				return;
 			}
 		}
@@ -66,13 +72,13 @@ void binop_t::addInstr(MathVm* instrs) const
 		
 	l->addInstr(instrs);
 	r->addInstr(instrs);
-	instrs->emplace_back(opcode());
+	instrs->emplace_back(opcode(), 0, 0, begin, end);
 }
 
 void unop_t::addInstr(MathVm* instrs) const
 {
 	l->addInstr(instrs);
-	instrs->emplace_back(opcode());
+	instrs->emplace_back(opcode(), 0, 0, begin, end);
 }
 
 bool const_t::equalsTo(const expr_t* other) const
@@ -111,21 +117,175 @@ bool unop_t::equalsTo(const expr_t* other) const
 	return false;
 }
 
-void MathVm::dump()
+void splitProduct(const expr_t* e, std::vector<const expr_t*>& factors)
+{
+	auto b = dynamic_cast<const binop_t*>(e);
+	if (b && b->op == '*')
+	{
+		splitProduct(&*b->l, factors);
+		splitProduct(&*b->r, factors);
+	}
+	else
+	{
+		factors.push_back(e);
+	}
+}
+
+void MathVm::link()
+{
+	clear();
+	for (size_t i = 0; i < factors.size(); ++i)
+	{
+		insert(end(), factors[i].begin(), factors[i].end());
+		emplace_back('Z');
+		if (i) emplace_back('*');
+	}
+	requiredStackSize = stackDepth();
+	compile();
+	findPolynomials();
+}
+
+void MathVm::calibrate(const QRectF& rect)
+{
+	if (factors.size() < 2)
+	{
+		return;
+	}
+	/* Samples are roughly pixel sized cells spread over the rect */
+	const int samples = 16;
+	real_t w = rect.width() / 512, h = rect.height() / 512;
+	std::vector<std::pair<double, size_t>> order;
+	for (size_t i = 0; i < factors.size(); ++i)
+	{
+		MathVm factor;
+		factor.assign(factors[i].begin(), factors[i].end());
+		factor.requiredStackSize = factor.stackDepth();
+		MathCtx ctx(factor.requiredStackSize);
+		int hits = 0;
+		for (int sx = 0; sx < samples; ++sx)
+		{
+			for (int sy = 0; sy < samples; ++sy)
+			{
+				real_t x = rect.left() + rect.width() * (sx + 0.5) / samples,
+					   y = rect.top() + rect.height() * (sy + 0.5) / samples;
+				ctx.setVar('x', Real(x, x + w));
+				ctx.setVar('y', Real(y, y + h));
+				try
+				{
+					hits += factor.execute(&ctx).isZero();
+				}
+				catch (Exception)
+				{
+				}
+			}
+		}
+		double cost = 0;
+		for (auto& instr : factor)
+		{
+			cost += instr.type == '^' ? 8 : instr.type == '/' ? 4 : instr.type == '*' ? 2 : 1;
+		}
+		/* For independent factors, evaluating them by decreasing chance to stop per unit of cost is optimal */
+		order.emplace_back(-(hits + 1) / cost, i);
+	}
+	std::stable_sort(order.begin(), order.end());
+	std::vector<std::vector<Instr>> sorted;
+	for (auto& o : order)
+	{
+		sorted.push_back(std::move(factors[o.second]));
+	}
+	factors = std::move(sorted);
+	link();
+}
+
+bool MathVm::reuseCtx(Ctx* _ctx) const
+{
+	MathCtx *ctx = dynamic_cast<MathCtx*>(_ctx);
+	if (!ctx || ctx->stackSize < requiredStackSize)
+	{
+		return false;
+	}
+	ctx->vars.fill(Real());
+	return true;
+}
+
+void MathVm::stackEffect(const Instr& i, int* needs, int* pushes)
+{
+	switch (i.type)
+	{
+		case 'C': case 'D':
+			*needs = i.type == 'D'; *pushes = 1;
+			break;
+		case 'V':
+			if (i.arg < 0 || i.arg >= 26)
+			{
+				throw Exception("Invalid variable in bytecode");
+			}
+			*needs = 0; *pushes = 1;
+			break;
+		case 'P':
+			if (i.val < 0 || i.val != int(i.val))
+			{
+				throw Exception("Invalid polynomial in bytecode");
+			}
+			*needs = 0; *pushes = 1;
+			break;
+		case '+': case '-': case '*': case '/': case '^': case 'p': case 'd':
+			*needs = 2; *pushes = -1;
+			break;
+		case 'm': case '|': case 'Z': case 'Q':
+			*needs = 1; *pushes = 0;
+			break;
+		case 'S':
+			*needs = 2; *pushes = 0;
+			break;
+		default:
+			throw Exception(QString("Unknown instruction: %1").arg(i.type));
+	}
+}
+
+int MathVm::stackDepth() const
 {
+	int depth = 0, maxDepth = 0;
 	for (auto& i : *this)
 	{
-		qDebug() << i.type << char(i.arg + 'a') << double(i.val);
+		int needs, pushes;
+		stackEffect(i, &needs, &pushes);
+		if (depth < needs)
+		{
+			throw Exception("Stack underflow in bytecode");
+		}
+		depth += pushes;
+		maxDepth = std::max(maxDepth, depth);
+	}
+	if (depth != 1)
+	{
+		throw Exception("Bytecode does not leave exactly one result");
 	}
+	return maxDepth;
 }
 
-Real MathVm::execute(Ctx* _ctx) const
+void MathVm::verify() const
+{
+	if (stackDepth() > requiredStackSize)
+	{
+		throw Exception("Stack overflow in bytecode");
+	}
+}
+
+void MathVm::dump()
 {
-	MathCtx *ctx = static_cast<MathCtx*>(_ctx);
-	ctx->reset();
-	Real a = 0, b = 0;
 	for (auto& i : *this)
 	{
+		qDebug() << i.type << char(i.arg + 'a') << double(i.val) << i.begin << i.end;
+	}
+}
+
+namespace
+{
+	/* Returns false when the instruction ends the program, the result is on top of the stack then */
+	inline bool step(MathCtx* ctx, const Instr& i)
+	{
+		Real a = 0, b = 0;
 		switch(i.type)
 		{
 			case 'C':
@@ -134,6 +294,9 @@ Real MathVm::execute(Ctx* _ctx) const
 			case 'V':
 				ctx->push(ctx->vars[static_cast<int>(i.arg)]);
 				break;
+			case 'P':
+				ctx->push(ctx->polys[static_cast<int>(i.val)]);
+				break;
 			case '+':
 				b = ctx->pop(); a = ctx->pop();
 				ctx->push(a + b);
@@ -150,6 +313,18 @@ Real MathVm::execute(Ctx* _ctx) const
 				b = ctx->pop(); a = ctx->pop();
 				ctx->push(a / b);
 				break;
+			case 'p':
+				/* Products of non-negative intervals, see MathVm::specialize() */
+				b = ctx->pop(); a = ctx->pop();
+				ctx->push(Real(a.min * b.min, a.max * b.max));
+				break;
+			case 'd':
+				b = ctx->pop(); a = ctx->pop();
+				ctx->push(a.divide(b));
+				break;
+			case 'Q':
+				ctx->push(ctx->pop().square());
+				break;
 			case 'm':
 				ctx->push(-ctx->pop());
 				break;
@@ -166,9 +341,237 @@ Real MathVm::execute(Ctx* _ctx) const
 			case 'S':
 				ctx->swap();
 				break;
+			case 'Z':
+				/* A factor which contains zero decides the whole product. Factors within EPS of zero do not,
+				 * the other factors may take the product beyond EPS */
+				return !ctx->top().containsZero();
 			default:
 				throw Exception(QString("Unknown instruction: %1").arg(i.type));
 		}
+		return true;
+	}
+
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+	inline quint64 cycles()
+	{
+		return __rdtsc();
+	}
+#else
+	/* Nanoseconds where there is no cycle counter */
+	inline quint64 cycles()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+#endif
+
+	/* The shortest interval which can be measured */
+	quint64 measureOverhead()
+	{
+		quint64 ret = ~quint64(0);
+		for (int i = 0; i < 1000; ++i)
+		{
+			quint64 start = cycles();
+			ret = std::min(ret, cycles() - start);
+		}
+		return ret;
+	}
+
+	const quint64 timerOverhead = measureOverhead();
+}
+
+Real MathVm::execute(Ctx* _ctx) const
+{
+	MathCtx *ctx = static_cast<MathCtx*>(_ctx);
+	/* On errors the interpreter runs the program again to throw the right exception */
+	if (jit && !runJit(&*jit, ctx->origStack.get(), ctx->vars.data(), ctx->polys))
+	{
+		return ctx->origStack[0];
+	}
+	ctx->reset();
+	for (auto& i : *this)
+	{
+		if (!step(ctx, i))
+		{
+			break;
+		}
 	}
 	return ctx->pop();
 }
+
+Real MathVm::profile(Ctx* _ctx, Profile& out) const
+{
+	MathCtx *ctx = static_cast<MathCtx*>(_ctx);
+	out.counts.resize(size());
+	out.cycles.resize(size());
+	bool sampled = out.runs++ % Profile::sampleRate == 0;
+	out.sampledRuns += sampled;
+	ctx->reset();
+	for (size_t k = 0; k < size(); ++k)
+	{
+		++out.counts[k];
+		quint64 start = sampled ? cycles() : 0;
+		bool more = step(ctx, (*this)[k]);
+		if (sampled)
+		{
+			/* Long intervals are interrupts or preemption */
+			quint64 spent = cycles() - start;
+			if (spent < 100000)
+			{
+				out.cycles[k] += spent > timerOverhead ? spent - timerOverhead : 0;
+			}
+		}
+		if (!more)
+		{
+			break;
+		}
+	}
+	return ctx->pop();
+}
+
+void Profile::merge(const Profile& other)
+{
+	counts.resize(std::max(counts.size(), other.counts.size()));
+	cycles.resize(counts.size());
+	for (size_t k = 0; k < other.counts.size(); ++k)
+	{
+		counts[k] += other.counts[k];
+		cycles[k] += other.cycles[k];
+	}
+	runs += other.runs;
+	sampledRuns += other.sampledRuns;
+}
+
+namespace
+{
+	const Real anything(-INFINITY, INFINITY);
+
+	/* a^n for integer n, RangeReal::pow() takes the absolute value of intervals which contain zero */
+	Real powInt(const Real& a, int n)
+	{
+		if (n < 0)
+		{
+			return a.isZero() ? anything : Real(1) / powInt(a, -n);
+		}
+		if (n % 2)
+		{
+			return Real(std::pow(a.min, n), std::pow(a.max, n));
+		}
+		Real m = a.abs();
+		return Real(std::pow(m.min, n), std::pow(m.max, n));
+	}
+
+	/* Derivative of a^b by a for a constant b */
+	Real powSlope(const Real& a, real_t b)
+	{
+		int n = std::lround(b);
+		if (fabs(b - n) < EPS)
+		{
+			return n ? Real(n) * powInt(a, n - 1) : Real(0);
+		}
+		if (a.min <= 0)
+		{
+			return anything;
+		}
+		real_t lo = std::pow(a.min, b - 1), hi = std::pow(a.max, b - 1);
+		return Real(b) * Real(std::min(lo, hi), std::max(lo, hi));
+	}
+
+	inline bool isConstant(const Dual& d)
+	{
+		return d.v.min == d.v.max && d.x.min == 0 && d.x.max == 0 && d.y.min == 0 && d.y.max == 0;
+	}
+
+	/* Values are computed like step() does, derivatives by the chain rule */
+	void stepGrad(Dual*& top, const Instr& i, const std::array<Real, 26>& vars)
+	{
+		Dual *a = top - 2, *b = top - 1;
+		switch(i.type)
+		{
+			case 'C':
+				*top++ = Dual{ i.val, 0, 0 };
+				break;
+			case 'V':
+				*top++ = Dual{ vars[static_cast<int>(i.arg)], i.arg == 'x' - 'a' ? 1 : 0, i.arg == 'y' - 'a' ? 1 : 0 };
+				break;
+			case '+':
+				*a = Dual{ a->v + b->v, a->x + b->x, a->y + b->y };
+				--top;
+				break;
+			case '-':
+				*a = Dual{ a->v - b->v, a->x - b->x, a->y - b->y };
+				--top;
+				break;
+			case '*':
+				*a = Dual{ a->v * b->v, a->x * b->v + a->v * b->x, a->y * b->v + a->v * b->y };
+				--top;
+				break;
+			case '/':
+			{
+				/* (a / b)' = (a' - a / b * b') / b */
+				Real q = a->v / b->v;
+				*a = Dual{ q, (a->x - q * b->x) / b->v, (a->y - q * b->y) / b->v };
+				--top;
+				break;
+			}
+			case 'm':
+				*b = Dual{ -b->v, -b->x, -b->y };
+				break;
+			case '|':
+				if (b->v.isZero())
+				{
+					/* The sign may change inside the cell */
+					real_t mx = std::max(-b->x.min, b->x.max), my = std::max(-b->y.min, b->y.max);
+					*b = Dual{ b->v.abs(), Real(-mx, mx), Real(-my, my) };
+				}
+				else if (b->v.max < 0)
+				{
+					*b = Dual{ b->v.abs(), -b->x, -b->y };
+				}
+				break;
+			case '^':
+				if (isConstant(*b))
+				{
+					Real slope = powSlope(a->v, b->v.min);
+					*a = Dual{ a->v.pow(b->v), slope * a->x, slope * a->y };
+				}
+				else if (a->v.min > 0)
+				{
+					/* (a ^ b)' = a ^ b * (b' * ln a + b * a' / a) */
+					Real v = a->v.pow(b->v), ln(std::log(a->v.min), std::log(a->v.max));
+					*a = Dual{ v, v * (b->x * ln + b->v * a->x / a->v), v * (b->y * ln + b->v * a->y / a->v) };
+				}
+				else
+				{
+					*a = Dual{ a->v.pow(b->v), anything, anything };
+				}
+				--top;
+				break;
+			case 'D':
+				*top = *b;
+				++top;
+				break;
+			case 'S':
+				std::swap(*a, *b);
+				break;
+			case 'Z':
+				break;
+			default:
+				throw Exception(QString("Unknown instruction: %1").arg(i.type));
+		}
+	}
+}
+
+Real MathVm::executeGrad(Ctx* _ctx, Real* dx, Real* dy) const
+{
+	MathCtx *ctx = static_cast<MathCtx*>(_ctx);
+	Dual *top = ctx->gradStack.get();
+	for (auto& i : *this)
+	{
+		stepGrad(top, i, ctx->vars);
+	}
+	--top;
+	*dx = top->x;
+	*dy = top->y;
+	return top->v;
+}